@@ -0,0 +1,134 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/epoll.hpp>
+#include <rethread/poll.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace
+{
+	// Pipe that always has a byte to read, so the waits complete at once and only their overhead is measured
+	class ready_pipe
+	{
+		int _fds[2];
+
+	public:
+		ready_pipe()
+		{
+			RETHREAD_CHECK(::pipe(_fds) == 0, std::runtime_error("pipe failed"));
+			char c = 0;
+			RETHREAD_CHECK(::write(_fds[1], &c, 1) == 1, std::runtime_error("write failed"));
+		}
+
+		~ready_pipe()
+		{
+			::close(_fds[0]);
+			::close(_fds[1]);
+		}
+
+		ready_pipe(const ready_pipe&) = delete;
+		ready_pipe& operator = (const ready_pipe&) = delete;
+
+		int read_fd() const
+		{ return _fds[0]; }
+
+		int write_fd() const
+		{ return _fds[1]; }
+	};
+}
+
+
+static void poll_raw(benchmark::State& state)
+{
+	ready_pipe p;
+	for (auto _ : state)
+	{
+		pollfd fd = { p.read_fd(), POLLIN, 0 };
+		benchmark::DoNotOptimize(::poll(&fd, 1, -1));
+	}
+}
+BENCHMARK(poll_raw);
+
+static void poll_cancellable(benchmark::State& state)
+{
+	ready_pipe p;
+	rethread::standalone_cancellation_token token;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(rethread::poll(p.read_fd(), POLLIN, token));
+}
+BENCHMARK(poll_cancellable);
+
+static void poll_dummy_token(benchmark::State& state)
+{
+	ready_pipe p;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(rethread::poll(p.read_fd(), POLLIN, rethread::dummy_cancellation_token()));
+}
+BENCHMARK(poll_dummy_token);
+
+
+static void read_write_raw(benchmark::State& state)
+{
+	ready_pipe p;
+	char c = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(::read(p.read_fd(), &c, 1));
+		benchmark::DoNotOptimize(::write(p.write_fd(), &c, 1));
+	}
+}
+BENCHMARK(read_write_raw);
+
+static void read_write_cancellable(benchmark::State& state)
+{
+	ready_pipe p;
+	rethread::standalone_cancellation_token token;
+	char c = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(rethread::read(p.read_fd(), &c, 1, token));
+		benchmark::DoNotOptimize(rethread::write(p.write_fd(), &c, 1, token));
+	}
+}
+BENCHMARK(read_write_cancellable);
+
+
+static void epoll_wait_raw(benchmark::State& state)
+{
+	ready_pipe p;
+	int epoll = ::epoll_create1(EPOLL_CLOEXEC);
+	epoll_event event = { };
+	event.events = EPOLLIN;
+	::epoll_ctl(epoll, EPOLL_CTL_ADD, p.read_fd(), &event);
+	epoll_event events[16];
+	for (auto _ : state)
+		benchmark::DoNotOptimize(::epoll_wait(epoll, events, 16, -1));
+	::close(epoll);
+}
+BENCHMARK(epoll_wait_raw);
+
+static void epoll_wait_cancellable(benchmark::State& state)
+{
+	ready_pipe p;
+	rethread::epoll_reactor reactor;
+	reactor.add(p.read_fd(), EPOLLIN);
+	rethread::standalone_cancellation_token token;
+	epoll_event events[16];
+	for (auto _ : state)
+		benchmark::DoNotOptimize(reactor.wait(events, 16, token));
+}
+BENCHMARK(epoll_wait_cancellable);
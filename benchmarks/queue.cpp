@@ -0,0 +1,159 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/concurrent_queue.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+	// The usual approach that rethread replaces: wait with a timeout and recheck the flag
+	template <typename T>
+	class timeout_concurrent_queue
+	{
+		std::mutex              _mutex;
+		std::deque<T>           _queue;
+		std::condition_variable _cv;
+
+	public:
+		void push(T value)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_queue.push_back(std::move(value));
+			_cv.notify_one();
+		}
+
+		bool pop(T& value, const std::atomic<bool>& alive)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			while (_queue.empty())
+			{
+				if (!alive)
+					return false;
+				_cv.wait_for(l, std::chrono::milliseconds(100));
+			}
+			value = std::move(_queue.front());
+			_queue.pop_front();
+			return true;
+		}
+	};
+
+
+	struct timeout_queues
+	{
+		timeout_concurrent_queue<int> _requests;
+		timeout_concurrent_queue<int> _responses;
+		std::atomic<bool>             _alive{true};
+
+		bool push_request(int value)
+		{ _requests.push(value); return true; }
+
+		bool pop_response(int& value)
+		{ return _responses.pop(value, _alive); }
+
+		void serve()
+		{
+			int value = 0;
+			while (_requests.pop(value, _alive))
+				_responses.push(value);
+		}
+
+		void stop()
+		{ _alive = false; }
+	};
+
+
+	struct cancellable_queues
+	{
+		rethread::concurrent_queue<int>         _requests;
+		rethread::concurrent_queue<int>         _responses;
+		rethread::standalone_cancellation_token _token;
+		rethread::dummy_cancellation_token      _dummy;
+
+		bool push_request(int value)
+		{ _requests.push(value); return true; }
+
+		bool pop_response(int& value)
+		{ return _responses.pop(value, _dummy); }
+
+		void serve()
+		{
+			int value = 0;
+			while (_requests.pop(value, _token))
+				_responses.push(value);
+		}
+
+		void stop()
+		{ _token.cancel(); }
+	};
+
+
+	struct bounded_queues
+	{
+		rethread::bounded_concurrent_queue<int> _requests{64};
+		rethread::bounded_concurrent_queue<int> _responses{64};
+		rethread::standalone_cancellation_token _token;
+		rethread::dummy_cancellation_token      _dummy;
+
+		bool push_request(int value)
+		{ return _requests.push(value, _dummy); }
+
+		bool pop_response(int& value)
+		{ return _responses.pop(value, _dummy); }
+
+		void serve()
+		{
+			int value = 0;
+			while (_requests.pop(value, _token))
+				_responses.push(value, _token);
+		}
+
+		void stop()
+		{ _token.cancel(); }
+	};
+
+
+	// Ping-pong between the benchmark thread and a server thread, so that every pop() blocks until the other side pushes
+	template <typename Queues>
+	void ping_pong(benchmark::State& state)
+	{
+		Queues queues;
+		std::thread server([&] { queues.serve(); });
+		int value = 0;
+		for (auto _ : state)
+		{
+			queues.push_request(value);
+			queues.pop_response(value);
+			++value;
+		}
+		queues.stop();
+		server.join();
+	}
+}
+
+
+static void queue_timeout_based(benchmark::State& state)
+{ ping_pong<timeout_queues>(state); }
+BENCHMARK(queue_timeout_based)->UseRealTime();
+
+static void queue_cancellable(benchmark::State& state)
+{ ping_pong<cancellable_queues>(state); }
+BENCHMARK(queue_cancellable)->UseRealTime();
+
+static void queue_bounded(benchmark::State& state)
+{ ping_pong<bounded_queues>(state); }
+BENCHMARK(queue_bounded)->UseRealTime();
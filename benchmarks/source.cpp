@@ -0,0 +1,105 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/cancellation_token.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	struct empty_handler : public rethread::cancellation_handler
+	{
+		void cancel() override { }
+		void reset() override { }
+	};
+
+
+	// Every token has a registered handler, otherwise cancel() has nothing to do but to close the registry
+	void cancel_source(benchmark::State& state, rethread::cancellation_fan_out fanOut)
+	{
+		const size_t count = static_cast<size_t>(state.range(0));
+		std::vector<empty_handler> handlers(count);
+		for (auto _ : state)
+		{
+			state.PauseTiming();
+			{
+				rethread::cancellation_token_source source;
+				std::deque<rethread::sourced_cancellation_token> tokens;
+				std::vector<rethread::cancellation_guard> guards;
+				guards.reserve(count);
+				for (size_t i = 0; i < count; ++i)
+				{
+					tokens.push_back(source.create_token());
+					guards.emplace_back(tokens.back(), handlers[i]);
+				}
+				state.ResumeTiming();
+
+				source.cancel(fanOut);
+
+				state.PauseTiming();
+			}
+			state.ResumeTiming();
+		}
+		state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(count));
+	}
+}
+
+
+static void cancel_sequential(benchmark::State& state)
+{ cancel_source(state, rethread::cancellation_fan_out::sequential); }
+BENCHMARK(cancel_sequential)->RangeMultiplier(8)->Range(8, 32768)->UseRealTime();
+
+static void cancel_batched(benchmark::State& state)
+{ cancel_source(state, rethread::cancellation_fan_out::batched); }
+BENCHMARK(cancel_batched)->RangeMultiplier(8)->Range(8, 32768)->UseRealTime();
+
+static void cancel_parallel(benchmark::State& state)
+{ cancel_source(state, rethread::cancellation_fan_out::parallel); }
+BENCHMARK(cancel_parallel)->RangeMultiplier(8)->Range(8, 32768)->UseRealTime();
+
+
+// Benchmark thread checks a token in a tight loop, while the other threads keep creating, initializing and destroying tokens
+// of the same source. Their registry links are written next to the checked token, unless tokens are cache line aligned
+static void is_cancelled_under_registry_churn(benchmark::State& state)
+{
+	rethread::cancellation_token_source source;
+	rethread::sourced_cancellation_token checked = source.create_token();
+	empty_handler handler;
+	{
+		rethread::cancellation_guard guard(checked, handler); // registers the checked token in the source
+	}
+
+	std::atomic<bool> alive{true};
+	std::vector<std::thread> churners;
+	for (int64_t i = 0; i < state.range(0); ++i)
+		churners.push_back(std::thread([&]
+			{
+				empty_handler h;
+				while (alive.load(std::memory_order_relaxed))
+				{
+					rethread::sourced_cancellation_token token = source.create_token();
+					rethread::cancellation_guard guard(token, h);
+					benchmark::DoNotOptimize(guard);
+				}
+			}));
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(checked.is_cancelled());
+
+	alive = false;
+	for (std::thread& t : churners)
+		t.join();
+}
+BENCHMARK(is_cancelled_under_registry_churn)->DenseRange(0, 3);
@@ -0,0 +1,221 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/deadline_cancellation_token.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace
+{
+	struct empty_handler : public rethread::cancellation_handler
+	{
+		void cancel() override { }
+		void reset() override { }
+	};
+
+
+	template <typename Token>
+	void register_unregister(benchmark::State& state, const Token& token)
+	{
+		empty_handler handler;
+		for (auto _ : state)
+		{
+			rethread::basic_cancellation_guard<Token> guard(token, handler);
+			benchmark::DoNotOptimize(guard);
+		}
+	}
+
+	template <typename Token>
+	void check_state(benchmark::State& state, const Token& token)
+	{
+		for (auto _ : state)
+			benchmark::DoNotOptimize(token.is_cancelled());
+	}
+
+
+	// Hands out blocks of a preallocated buffer, and never frees them until the arena is destroyed
+	class arena
+	{
+		std::unique_ptr<unsigned char[]> _buffer;
+		size_t                           _size;
+		size_t                           _used{0};
+
+	public:
+		explicit arena(size_t size) : _buffer(new unsigned char[size]), _size(size)
+		{ }
+
+		void* allocate(size_t size, size_t alignment)
+		{
+			size_t offset = (_used + alignment - 1) & ~(alignment - 1);
+			if (offset + size > _size)
+				throw std::bad_alloc();
+			_used = offset + size;
+			return _buffer.get() + offset;
+		}
+
+		void clear()
+		{ _used = 0; }
+	};
+
+
+	template <typename T>
+	struct arena_allocator
+	{
+		using value_type = T;
+
+		arena* _arena;
+
+		explicit arena_allocator(arena& a) : _arena(&a)
+		{ }
+
+		template <typename U>
+		arena_allocator(const arena_allocator<U>& other) : _arena(other._arena)
+		{ }
+
+		T* allocate(size_t n)
+		{ return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T))); }
+
+		void deallocate(T*, size_t)
+		{ }
+
+		template <typename U>
+		bool operator == (const arena_allocator<U>& other) const
+		{ return _arena == other._arena; }
+
+		template <typename U>
+		bool operator != (const arena_allocator<U>& other) const
+		{ return _arena != other._arena; }
+	};
+}
+
+
+static void register_unregister_dummy(benchmark::State& state)
+{ register_unregister(state, rethread::dummy_cancellation_token()); }
+BENCHMARK(register_unregister_dummy);
+
+static void register_unregister_standalone(benchmark::State& state)
+{ register_unregister(state, rethread::standalone_cancellation_token()); }
+BENCHMARK(register_unregister_standalone);
+
+static void register_unregister_sourced(benchmark::State& state)
+{
+	rethread::cancellation_token_source source;
+	register_unregister(state, source.create_token());
+}
+BENCHMARK(register_unregister_sourced);
+
+static void register_unregister_deadline(benchmark::State& state)
+{ register_unregister(state, rethread::deadline_cancellation_token(std::chrono::hours(1))); }
+BENCHMARK(register_unregister_deadline);
+
+static void register_unregister_erased(benchmark::State& state)
+{
+	rethread::standalone_cancellation_token token;
+	register_unregister<rethread::cancellation_token>(state, token);
+}
+BENCHMARK(register_unregister_erased);
+
+
+static void is_cancelled_standalone(benchmark::State& state)
+{ check_state(state, rethread::standalone_cancellation_token()); }
+BENCHMARK(is_cancelled_standalone);
+
+// Sourced token is registered in its source lazily, on the first handler registration
+static void is_cancelled_sourced_lazy(benchmark::State& state)
+{
+	rethread::cancellation_token_source source;
+	check_state(state, source.create_token());
+}
+BENCHMARK(is_cancelled_sourced_lazy);
+
+static void is_cancelled_sourced_initialized(benchmark::State& state)
+{
+	rethread::cancellation_token_source source;
+	rethread::sourced_cancellation_token token = source.create_token();
+	empty_handler handler;
+	{
+		rethread::cancellation_guard guard(token, handler);
+	}
+	check_state(state, token);
+}
+BENCHMARK(is_cancelled_sourced_initialized);
+
+
+static void create_standalone_token(benchmark::State& state)
+{
+	for (auto _ : state)
+	{
+		rethread::standalone_cancellation_token token;
+		benchmark::DoNotOptimize(token);
+	}
+}
+BENCHMARK(create_standalone_token)->ThreadRange(1, 8);
+
+static void create_heap_standalone_token(benchmark::State& state)
+{
+	for (auto _ : state)
+	{
+		std::unique_ptr<rethread::standalone_cancellation_token> token(new rethread::standalone_cancellation_token());
+		benchmark::DoNotOptimize(token);
+	}
+}
+BENCHMARK(create_heap_standalone_token)->ThreadRange(1, 8);
+
+static void create_source(benchmark::State& state)
+{
+	for (auto _ : state)
+	{
+		rethread::cancellation_token_source source;
+		benchmark::DoNotOptimize(source);
+	}
+}
+BENCHMARK(create_source)->ThreadRange(1, 8);
+
+static void create_source_in_arena(benchmark::State& state)
+{
+	arena a(1 << 20);
+	for (auto _ : state)
+	{
+		{
+			rethread::cancellation_token_source source((arena_allocator<char>(a)));
+			benchmark::DoNotOptimize(source);
+		}
+		a.clear();
+	}
+}
+BENCHMARK(create_source_in_arena)->ThreadRange(1, 8);
+
+// Tokens of a shared source are created and destroyed by all threads at once
+static void create_token(benchmark::State& state)
+{
+	static rethread::cancellation_token_source source;
+	for (auto _ : state)
+	{
+		rethread::sourced_cancellation_token token = source.create_token();
+		benchmark::DoNotOptimize(token);
+	}
+}
+BENCHMARK(create_token)->ThreadRange(1, 8);
+
+static void create_deadline_token(benchmark::State& state)
+{
+	for (auto _ : state)
+	{
+		rethread::deadline_cancellation_token token(std::chrono::hours(1));
+		benchmark::DoNotOptimize(token);
+	}
+}
+BENCHMARK(create_deadline_token)->ThreadRange(1, 8);
@@ -0,0 +1,233 @@
+#ifndef RETHREAD_ATOMIC_HPP
+#define RETHREAD_ATOMIC_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/config.hpp>
+#include <rethread/detail/futex.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+
+namespace rethread
+{
+	namespace detail
+	{
+		/// @brief Waiters of arbitrary atomics sleep on the epoch of a bucket selected by address.
+		///        Notifier changes the atomic, and then bumps the epoch if there are waiters in the bucket,
+		///        while waiter registers itself, reads the epoch and only then checks the atomic. So the epoch always changes after
+		///        the waiter has seen the old value, and waiting for the epoch can't miss a notification.
+		template <typename Dummy_ = void>
+		struct atomic_wait_table
+		{
+			struct bucket_data
+			{
+				futex_word            _epoch{0};
+				std::atomic<uint32_t> _waiters{0};
+			};
+
+			struct bucket : public bucket_data
+			{
+				char _padding[RETHREAD_CACHE_LINE_SIZE - sizeof(bucket_data) % RETHREAD_CACHE_LINE_SIZE];
+			};
+
+			static RETHREAD_CONSTEXPR size_t BucketsCount = 64;
+			static bucket                    s_buckets[BucketsCount];
+
+			static bucket& get_bucket(const void* address)
+			{ return s_buckets[(reinterpret_cast<std::uintptr_t>(address) >> 2) % BucketsCount]; }
+
+			static void notify(const void* address)
+			{
+				bucket& b = get_bucket(address);
+				// Caller's store to the atomic may be relaxed, so without the fence loading the counter could pass it
+				// (store buffering), and both sides would miss each other. Pairs with the seq_cst increment of the waiter
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (RETHREAD_LIKELY(b._waiters.load(std::memory_order_relaxed) == 0))
+					return;
+				b._epoch.fetch_add(1);
+				futex_wake_all(b._epoch);
+			}
+		};
+
+		template <typename Dummy_>
+		typename atomic_wait_table<Dummy_>::bucket atomic_wait_table<Dummy_>::s_buckets[atomic_wait_table<Dummy_>::BucketsCount];
+
+
+		class atomic_cancellation_handler : public cancellation_handler
+		{
+			futex_word& _epoch;
+
+		public:
+			explicit atomic_cancellation_handler(futex_word& epoch) : _epoch(epoch)
+			{ }
+
+			void cancel() override
+			{
+				_epoch.fetch_add(1);
+				futex_wake_all(_epoch);
+			}
+		};
+
+
+		/// @brief Wakes cancellable waiters of a futex word. Whoever changes the word calls it after the usual futex wake.
+		///        Costs a fence and a load if nobody waits
+		inline void notify_cancellable_waiters(const futex_word& word)
+		{ atomic_wait_table<>::notify(&word); }
+
+
+		/// @brief Futex protocol doesn't let the handler change the word, so a wake-up sent between checking the token
+		///        and falling asleep would be lost. Cancellable waits sleep on the epoch of the word's bucket instead, which the
+		///        handler bumps before a single wake, and the wakers bump through notify_cancellable_waiters().
+		///        The handler is registered once for all sleeps of a wait loop on the same word
+		template <typename Token_ = cancellation_token>
+		class futex_cancellation_guard
+		{
+			using table = atomic_wait_table<>;
+
+			const futex_word&           _word;
+			const cancellation_token&   _token;
+			table::bucket&              _bucket;
+			atomic_cancellation_handler _handler;
+			cancellation_guard          _guard;
+
+		public:
+			futex_cancellation_guard(const futex_word& word, const cancellation_token& token) :
+				_word(word), _token(token), _bucket(table::get_bucket(&word)), _handler(_bucket._epoch), _guard(token, _handler)
+			{ _bucket._waiters.fetch_add(1); }
+
+			~futex_cancellation_guard()
+			{ _bucket._waiters.fetch_sub(1); }
+
+			futex_cancellation_guard(const futex_cancellation_guard&) = delete;
+			futex_cancellation_guard& operator = (const futex_cancellation_guard&) = delete;
+
+			bool is_cancelled() const
+			{ return _guard.is_cancelled(); }
+
+			/// @brief Blocks while the word equals expected and the token is not cancelled. May return spuriously
+			/// @note  The epoch is read before the checks, so a change of the word or a cancel after them makes the sleep return at once
+			void wait(uint32_t expected)
+			{
+				uint32_t epoch = _bucket._epoch.load();
+				if (_word.load() == expected && _token)
+					futex_wait(_bucket._epoch, epoch);
+			}
+		};
+
+
+		/// @brief Nothing can cancel the wait, so it sleeps on the word itself, and a single waiter can be woken by futex_wake_one()
+		template <>
+		class futex_cancellation_guard<dummy_cancellation_token>
+		{
+			const futex_word& _word;
+
+		public:
+			futex_cancellation_guard(const futex_word& word, const dummy_cancellation_token&) : _word(word)
+			{ }
+
+			futex_cancellation_guard(const futex_cancellation_guard&) = delete;
+			futex_cancellation_guard& operator = (const futex_cancellation_guard&) = delete;
+
+			bool is_cancelled() const
+			{ return false; }
+
+			void wait(uint32_t expected)
+			{ futex_wait(_word, expected); }
+		};
+	}
+
+
+	/// @brief   Blocks while value equals old, similarly to C++20 std::atomic::wait(), but can be cancelled.
+	///          The handler doesn't need any mutex - it just wakes the waiter.
+	/// @note    Whoever changes the value should call rethread::notify_one() or rethread::notify_all() afterwards
+	/// @returns True if value has changed, false if cancelled
+	template <typename T, typename Token>
+	typename detail::enable_if_token<Token, bool>::type wait(std::atomic<T>& value, typename std::common_type<T>::type old, const Token& token)
+	{
+		if (value.load() != old) // registering handler is not free, so it makes sense to check the value
+			return true;
+
+		using table = detail::atomic_wait_table<>;
+		table::bucket& b = table::get_bucket(&value);
+
+		detail::atomic_cancellation_handler handler(b._epoch);
+		basic_cancellation_guard<Token> guard(token, handler);
+		if (guard.is_cancelled())
+			return false;
+
+		b._waiters.fetch_add(1);
+		bool result = true;
+		for (;;)
+		{
+			uint32_t epoch = b._epoch.load();
+			if (value.load() != old)
+				break;
+			if (cancellation_token_traits<Token>::is_cancelled(token))
+			{
+				result = false;
+				break;
+			}
+			detail::futex_wait(b._epoch, epoch);
+		}
+		b._waiters.fetch_sub(1);
+		return result;
+	}
+
+
+	/// @brief Wakes threads that wait for value in rethread::wait(). Costs a single load if nobody waits
+	template <typename T>
+	void notify_one(std::atomic<T>& value)
+	{ detail::atomic_wait_table<>::notify(&value); } // waiters of different atomics share buckets, so waking only one of them could lose a wake-up
+
+
+	template <typename T>
+	void notify_all(std::atomic<T>& value)
+	{ detail::atomic_wait_table<>::notify(&value); }
+
+
+	/// @brief   Cancellable version of the raw futex wait, for words that are woken by futex_wake_one() or futex_wake_all()
+	///          instead of rethread::notify_one()
+	/// @returns False if cancelled. Similarly to the raw futex, may return spuriously
+	inline bool futex_wait(std::atomic<uint32_t>& word, uint32_t old, const cancellation_token& token)
+	{
+		if (word.load() != old)
+			return true;
+
+		detail::futex_cancellation_guard<> guard(word, token);
+		if (guard.is_cancelled())
+			return false;
+
+		guard.wait(old);
+		return static_cast<bool>(token);
+	}
+
+
+	/// @note Cancellable waiters sleep on a shared epoch, so they are all woken, like by futex_wake_all()
+	inline void futex_wake_one(std::atomic<uint32_t>& word)
+	{
+		detail::futex_wake_one(word);
+		detail::notify_cancellable_waiters(word);
+	}
+
+
+	inline void futex_wake_all(std::atomic<uint32_t>& word)
+	{
+		detail::futex_wake_all(word);
+		detail::notify_cancellable_waiters(word);
+	}
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef RETHREAD_BARRIER_HPP
+#define RETHREAD_BARRIER_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/atomic.hpp>
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/futex.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+namespace rethread
+{
+	namespace detail
+	{
+		struct barrier_no_completion
+		{
+			void operator () () const
+			{ }
+		};
+	}
+
+
+	/// @brief Reusable thread barrier with cancellable wait, similar to C++20 std::barrier.
+	///        Threads sleep on the phase number (cancellable waits on its epoch), which the last arriving thread increments after running the completion function.
+	///        Arrivals that don't complete the phase are a single atomic operation, and cancellation handler is registered only
+	///        when a thread has to block.
+	/// @note  Cancelled wait doesn't undo the arrival, so the phase still completes once the rest of the threads arrive
+	template <typename CompletionFunction = detail::barrier_no_completion>
+	class barrier
+	{
+	public:
+		using arrival_token = uint32_t;
+
+	private:
+		std::atomic<uint32_t>         _expected;
+		std::atomic<uint32_t>         _remaining;
+		detail::futex_word            _phase{0};
+		mutable std::atomic<uint32_t> _waiters{0};
+		CompletionFunction            _completion;
+
+	public:
+		explicit barrier(uint32_t expected, CompletionFunction completion = CompletionFunction()) :
+			_expected(expected), _remaining(expected), _completion(std::move(completion))
+		{ }
+
+		barrier(const barrier&) = delete;
+		barrier& operator = (const barrier&) = delete;
+
+		arrival_token arrive(uint32_t update = 1)
+		{
+			// Phase is read before arriving, since the phase may complete right after that
+			arrival_token phase = _phase.load(std::memory_order_relaxed);
+			uint32_t remaining = _remaining.fetch_sub(update, std::memory_order_acq_rel);
+			RETHREAD_ASSERT(remaining >= update, "Barrier counter underflow!");
+			if (remaining == update)
+				complete_phase();
+			return phase;
+		}
+
+		void wait(arrival_token phase) const
+		{ wait_impl(phase, dummy_cancellation_token()); }
+
+		/// @returns False if cancelled
+		bool wait(arrival_token phase, const cancellation_token& token) const
+		{ return wait_impl(phase, token); }
+
+		void arrive_and_wait()
+		{ wait(arrive()); }
+
+		/// @returns False if cancelled. The thread has arrived anyway
+		bool arrive_and_wait(const cancellation_token& token)
+		{ return wait(arrive(), token); }
+
+		/// @brief Arrives, and decrements the expected count of the following phases
+		void arrive_and_drop()
+		{
+			_expected.fetch_sub(1, std::memory_order_relaxed); // published to the completing thread by the arrival below
+			arrive();
+		}
+
+	private:
+		template <typename Token>
+		bool wait_impl(arrival_token phase, const Token& token) const
+		{
+			if (_phase.load(std::memory_order_acquire) != phase)
+				return true;
+
+			detail::futex_cancellation_guard<Token> guard(_phase, token);
+			if (guard.is_cancelled())
+				return false;
+
+			// Pairs with complete_phase(): either the waiter sees the new phase, or the last arriving thread sees the waiter
+			_waiters.fetch_add(1);
+			bool result = true;
+			while (_phase.load() == phase)
+			{
+				if (!token)
+				{
+					result = false;
+					break;
+				}
+				guard.wait(phase);
+			}
+			_waiters.fetch_sub(1, std::memory_order_relaxed);
+			return result;
+		}
+
+		void complete_phase()
+		{
+			_completion();
+			_remaining.store(_expected.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			_phase.fetch_add(1);
+			if (_waiters.load() != 0)
+			{
+				detail::futex_wake_all(_phase);
+				detail::notify_cancellable_waiters(_phase);
+			}
+		}
+	};
+
+
+	/// @returns False if cancelled. The thread has arrived anyway
+	template <typename CompletionFunction>
+	bool arrive_and_wait(barrier<CompletionFunction>& b, const cancellation_token& token)
+	{ return b.arrive_and_wait(token); }
+}
+
+#endif
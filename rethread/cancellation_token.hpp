@@ -10,17 +10,27 @@
 // IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
 // WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
+#include <rethread/instrumentation.hpp>
+#include <rethread/detail/aligned_allocation.hpp>
+#include <rethread/detail/futex.hpp>
 #include <rethread/detail/intrusive_list.hpp>
 #include <rethread/detail/reverse_lock.hpp>
+#include <rethread/detail/spin.hpp>
 #include <rethread/detail/utility.hpp>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
-#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace rethread
 {
@@ -42,21 +52,67 @@ namespace rethread
 	class cancellation_token;
 
 
-	namespace this_thread
+	/// @brief Node of the intrusive list of callbacks kept by every token. Use cancellation_callback instead
+	class cancellation_callback_base
 	{
-		template<typename Rep, typename Period>
-		inline void sleep_for(const std::chrono::duration<Rep, Period>& duration, const cancellation_token& token);
-	}
+		cancellation_callback_base* _next{nullptr};
+		detail::futex_word          _done{0};            // 1 when invoke() returned, 2 if someone waits for it
+		bool*                       _destroyed{nullptr}; // lets the callback destroy itself while being invoked
+		std::thread::id             _executor;
+		const cancellation_token*   _token{nullptr};
+
+	public:
+		cancellation_callback_base(const cancellation_callback_base&) = delete;
+		cancellation_callback_base& operator =(const cancellation_callback_base&) = delete;
+
+	protected:
+		cancellation_callback_base() = default;
+		virtual ~cancellation_callback_base() { }
+
+		virtual void invoke() = 0;
+
+		/// @brief Invokes the callback in place if the token is already cancelled
+		inline void register_callback(const cancellation_token& token);
+
+		/// @post Callback isn't running in other threads and won't be invoked
+		inline void unregister_callback();
+
+	private:
+		friend class cancellation_token;
+	};
+
 
+	template <typename Token>
+	struct cancellation_token_traits;
 
-	class cancellation_token
+
+	class RETHREAD_TOKEN_ALIGNAS cancellation_token
 	{
 	protected:
 		mutable std::atomic<cancellation_handler*> _cancel_handler{nullptr};
 
+		static RETHREAD_CONSTEXPR uintptr_t CallbacksLockedBit = 1;
+		static RETHREAD_CONSTEXPR uintptr_t CallbacksClosedBit = 2;
+		static RETHREAD_CONSTEXPR uintptr_t CallbacksFlags = CallbacksLockedBit | CallbacksClosedBit;
+
+		// Head of the callbacks list and two flags in lower bits. Closed flag is set when callbacks are invoked
+		mutable std::atomic<uintptr_t> _callbacks{0};
+
+#ifdef RETHREAD_CACHE_LINE_ALIGNED_TOKENS
+		// Derived tokens could place their members into the tail padding of the aligned base, so the rest of the line is reserved
+		char _padding[RETHREAD_CACHE_LINE_SIZE - sizeof(void*) - sizeof(_cancel_handler) - sizeof(_callbacks)];
+#endif
+
 	public:
+		RETHREAD_TOKEN_ALIGNED_NEW
+
 		bool is_cancelled() const
-		{ return _cancel_handler.load(std::memory_order_relaxed) == cancelled_invalid_pointer(); }
+		{
+			cancellation_handler* h = _cancel_handler.load(std::memory_order_relaxed);
+			if (RETHREAD_UNLIKELY(h == not_initialized_invalid_pointer()))
+				return !try_initialize();
+			return h == cancelled_invalid_pointer();
+		}
 
 		explicit operator bool() const
 		{ return !is_cancelled(); }
@@ -107,6 +163,123 @@ namespace rethread
 			return false;
 		}
 
+		/// @brief Performs lazy initialization without registering a handler
+		/// @returns False if token is cancelled
+		bool try_initialize() const
+		{
+			cancellation_handler* h = not_initialized_invalid_pointer();
+			if (_cancel_handler.compare_exchange_strong(h, nullptr, std::memory_order_relaxed))
+				return do_initialize();
+			return h != cancelled_invalid_pointer();
+		}
+
+		/// @brief Closes the callbacks list, if it is empty
+		/// @returns False if there are callbacks to invoke
+		bool try_close_empty_callbacks() const
+		{
+			uintptr_t head = 0;
+			return _callbacks.compare_exchange_strong(head, CallbacksClosedBit, std::memory_order_acq_rel) || head == CallbacksClosedBit;
+		}
+
+		/// @brief Closes the callbacks list and invokes all callbacks. Should be invoked once the token enters cancelled state
+		/// @note  Mutexes shouldn't be held here, since callbacks may do anything
+		void invoke_callbacks() const
+		{
+			uintptr_t head = lock_callbacks() | CallbacksClosedBit;
+			while (cancellation_callback_base* callback = get_callback(head))
+			{
+				head = reinterpret_cast<uintptr_t>(callback->_next) | CallbacksClosedBit;
+				bool destroyed = false;
+				callback->_destroyed = &destroyed;
+				callback->_executor = std::this_thread::get_id();
+				_callbacks.store(head, std::memory_order_release);
+
+				callback->invoke();
+
+				head = lock_callbacks();
+				if (destroyed)
+					continue;
+				callback->_destroyed = nullptr;
+				if (callback->_done.exchange(1, std::memory_order_release) == 2)
+					detail::futex_wake_all(callback->_done);
+			}
+			_callbacks.store(head & ~CallbacksLockedBit, std::memory_order_release);
+		}
+
+	private:
+		/// @returns False if callbacks are already invoked
+		bool try_push_callback(cancellation_callback_base& callback) const
+		{
+			uintptr_t head = _callbacks.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				if (head & CallbacksClosedBit)
+					return false;
+				if (head & CallbacksLockedBit)
+				{
+					detail::cpu_relax();
+					head = _callbacks.load(std::memory_order_relaxed);
+					continue;
+				}
+				callback._next = get_callback(head);
+				if (_callbacks.compare_exchange_weak(head, reinterpret_cast<uintptr_t>(&callback), std::memory_order_release, std::memory_order_relaxed))
+					return true;
+			}
+		}
+
+		void remove_callback(cancellation_callback_base& callback) const
+		{
+			uintptr_t head = lock_callbacks();
+			cancellation_callback_base* prev = nullptr;
+			cancellation_callback_base* cur = get_callback(head);
+			while (cur && cur != &callback)
+			{
+				prev = cur;
+				cur = cur->_next;
+			}
+
+			if (cur)
+			{
+				if (prev)
+					prev->_next = cur->_next;
+				else
+					head = reinterpret_cast<uintptr_t>(cur->_next) | (head & CallbacksFlags);
+				_callbacks.store(head & ~CallbacksLockedBit, std::memory_order_release);
+				return;
+			}
+
+			// Callback is either running or has already finished
+			bool self = callback._destroyed && callback._executor == std::this_thread::get_id();
+			if (self)
+				*callback._destroyed = true;
+			_callbacks.store(head & ~CallbacksLockedBit, std::memory_order_release);
+			if (self)
+				return;
+
+			uint32_t done = 0;
+			if (callback._done.compare_exchange_strong(done, 2, std::memory_order_acquire) || done == 2)
+				for (done = 2; done == 2; done = callback._done.load(std::memory_order_acquire))
+					detail::futex_wait(callback._done, 2);
+		}
+
+		uintptr_t lock_callbacks() const
+		{
+			uintptr_t head = _callbacks.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				if (head & CallbacksLockedBit)
+				{
+					detail::cpu_relax();
+					head = _callbacks.load(std::memory_order_relaxed);
+				}
+				else if (_callbacks.compare_exchange_weak(head, head | CallbacksLockedBit, std::memory_order_acquire, std::memory_order_relaxed))
+					return head | CallbacksLockedBit;
+			}
+		}
+
+		static cancellation_callback_base* get_callback(uintptr_t head)
+		{ return reinterpret_cast<cancellation_callback_base*>(head & ~CallbacksFlags); }
+
 	protected:
 		cancellation_token() = default;
 
@@ -126,9 +299,61 @@ namespace rethread
 
 	private:
 		friend class cancellation_guard_base;
+		friend class cancellation_callback_base;
+
+		template <typename Token>
+		friend struct cancellation_token_traits;
+	};
+
+#ifdef RETHREAD_CACHE_LINE_ALIGNED_TOKENS
+	static_assert(sizeof(cancellation_token) == RETHREAD_CACHE_LINE_SIZE, "Hot state of the token should fill exactly one cache line");
+#endif
+
+
+	inline void cancellation_callback_base::register_callback(const cancellation_token& token)
+	{
+		RETHREAD_ASSERT(!_token, "Callback is already registered!");
+		// is_cancelled() also initializes lazy tokens, so that cancellation could find the callback
+		if (!token.is_cancelled())
+		{
+			_token = &token; // set in advance, since a concurrent cancel() may invoke the callback, and it may destroy itself
+			if (token.try_push_callback(*this))
+				return;
+			_token = nullptr;
+		}
+		invoke();
+	}
+
+
+	inline void cancellation_callback_base::unregister_callback()
+	{
+		if (!_token)
+			return;
+		_token->remove_callback(*this);
+		_token = nullptr;
+	}
+
+
+	/// @brief Invokes function once the token is cancelled, or in place if it is cancelled already.
+	///        Any number of callbacks can be attached to a single token, and registration is a single CAS if there's no contention.
+	///        Destructor waits for the function if it's running in another thread, so the function may be destroyed safely afterwards.
+	/// @note  Function is invoked from the thread that cancels the token, and shouldn't block
+	template <typename Function = std::function<void()>>
+	class cancellation_callback : public cancellation_callback_base
+	{
+		Function _func;
 
-		template<typename Rep, typename Period>
-		friend void this_thread::sleep_for(const std::chrono::duration<Rep, Period>& duration, const cancellation_token& token);
+	public:
+		template <typename F>
+		cancellation_callback(const cancellation_token& token, F&& f) : _func(std::forward<F>(f))
+		{ register_callback(token); }
+
+		~cancellation_callback()
+		{ unregister_callback(); }
+
+	private:
+		void invoke() override
+		{ _func(); }
 	};
 
 
@@ -142,108 +367,233 @@ namespace rethread
 		~dummy_cancellation_token() = default;
 
 	protected:
-		void do_sleep_for(const std::chrono::nanoseconds& duration) const override
+		void do_sleep_for(const std::chrono::nanoseconds& duration) const override final
 		{ std::this_thread::sleep_for(duration); }
 
 		// Just in case someone skips try_unregister_cancellation_handler and calls this directly
-		void unregister_cancellation_handler(cancellation_handler& h) const override
+		void unregister_cancellation_handler(cancellation_handler& h) const override final
 		{
 			bool r = try_unregister_cancellation_handler(h);
 			(void)r;
 			RETHREAD_ASSERT(r, "Dummy cancellation token can't be cancelled!");
 		}
+
+		template <typename Token>
+		friend struct cancellation_token_traits;
 	};
 
 
 	class standalone_cancellation_token : public cancellation_token
 	{
-		mutable std::mutex              _mutex;
-		mutable std::condition_variable _cv;
-		bool                            _cancelled{false};
-		bool                            _cancel_done{false};
+		static RETHREAD_CONSTEXPR uint32_t CancelledFlag = 1;
+		static RETHREAD_CONSTEXPR uint32_t CancelDoneFlag = 2;
+
+		// Both flags are kept in a single word, so waiting for them doesn't require mutex and condition variable
+		mutable detail::futex_word _state{0};
 
 	public:
 		standalone_cancellation_token() = default;
 		standalone_cancellation_token(const standalone_cancellation_token&) = delete;
 		standalone_cancellation_token& operator =(const standalone_cancellation_token&) = delete;
-		~standalone_cancellation_token() = default;
+
+		/// @note If cancel() is running in another thread (e.g. it has just resumed the owner of the token), waits for it to finish
+		~standalone_cancellation_token()
+		{
+			if ((_state.load(std::memory_order_acquire) & (CancelledFlag | CancelDoneFlag)) == CancelledFlag)
+				wait_cancel_done();
+		}
 
 		void cancel()
 		{
-			std::unique_lock<std::mutex> l(_mutex);
-			if (_cancelled)
+			if (_state.fetch_or(CancelledFlag) & CancelledFlag)
 				return;
 
-			_cancelled = true;
-			l.unlock();
-
 			cancellation_handler* cancelHandler = _cancel_handler.exchange(cancelled_invalid_pointer());
-			RETHREAD_ASSERT(cancelHandler != cancelled_invalid_pointer(), "_cancelled should protect from double-cancelling");
+			RETHREAD_ASSERT(cancelHandler != cancelled_invalid_pointer(), "_state should protect from double-cancelling");
 
 			if (cancelHandler)
 			{
 				RETHREAD_ANNOTATE_AFTER(std::addressof(_cancel_handler));
 				RETHREAD_ANNOTATE_FORGET(std::addressof(_cancel_handler));
-				cancelHandler->cancel();
+				{
+					RETHREAD_INSTRUMENT_TIMER(timer, handler_cancel, cancelHandler);
+					cancelHandler->cancel();
+				}
 				RETHREAD_ANNOTATE_BEFORE(cancelHandler);
 			}
+			invoke_callbacks();
 
-			l.lock();
-			_cancel_done = true;
-			_cv.notify_all();
+			// Waiter may destroy the token as soon as it sees CancelDoneFlag. Waking a destroyed word is harmless, reading it is not
+			_state.store(CancelledFlag | CancelDoneFlag);
+			detail::futex_wake_all(_state);
 		}
 
 		void reset()
 		{
-			std::unique_lock<std::mutex> l(_mutex);
-			RETHREAD_ASSERT((_cancel_handler.load() || _cancel_handler == cancelled_invalid_pointer()) && (_cancelled == _cancel_done), "Cancellation token is in use!");
-			_cancelled = false;
-			_cancel_done = false;
+			uint32_t state = _state.load();
+			(void)state;
+			RETHREAD_ASSERT((!_cancel_handler.load() || _cancel_handler == cancelled_invalid_pointer()) && (state == 0 || state == (CancelledFlag | CancelDoneFlag)), "Cancellation token is in use!");
+			RETHREAD_ASSERT(_callbacks.load() == 0 || _callbacks.load() == CallbacksClosedBit, "Callbacks are still registered!");
 			_cancel_handler = nullptr;
+			_callbacks = 0;
+			_state = 0;
 		}
 
 	protected:
-		void do_sleep_for(const std::chrono::nanoseconds& duration) const override
+		void do_sleep_for(const std::chrono::nanoseconds& duration) const override final
 		{
-			std::unique_lock<std::mutex> l(_mutex);
-			if (_cancelled)
-				return;
-
-			_cv.wait_for(l, duration);
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + duration;
+			for (uint32_t state = _state.load(); !(state & CancelledFlag); state = _state.load())
+			{
+				const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if (now >= deadline)
+					return;
+				detail::futex_wait_for(_state, state, deadline - now);
+			}
 		}
 
-		void unregister_cancellation_handler(cancellation_handler& handler) const override
+		void unregister_cancellation_handler(cancellation_handler& handler) const override final
 		{
 			if (try_unregister_cancellation_handler(handler))
 				return;
 
-			std::unique_lock<std::mutex> l(_mutex);
-			RETHREAD_ASSERT(_cancelled, "Wasn't cancelled!");
+			RETHREAD_ASSERT(_state & CancelledFlag, "Wasn't cancelled!");
 			RETHREAD_ASSERT(_cancel_handler.load() == cancelled_invalid_pointer(), "Wrong _cancel_handler");
+			RETHREAD_INSTRUMENT(unregister_race_lost, this, 1);
 
-			while (!_cancel_done)
-				_cv.wait(l);
+			wait_cancel_done();
 
 			RETHREAD_ANNOTATE_AFTER(std::addressof(handler));
 			RETHREAD_ANNOTATE_FORGET(std::addressof(handler));
-			l.unlock();
 			handler.reset();
 		}
+
+	private:
+		void wait_cancel_done() const
+		{
+			RETHREAD_INSTRUMENT_TIMER(timer, cancel_done_wait, this);
+			// Most handlers finish quickly, and a short spin is much cheaper than falling asleep and being woken up
+			uint32_t spins = 0;
+			if (detail::adaptive_spin<>::spin_until([this] { return (_state.load(std::memory_order_acquire) & CancelDoneFlag) != 0; }, spins))
+				RETHREAD_INSTRUMENT(cancel_done_spin, this, spins);
+			else
+			{
+				RETHREAD_INSTRUMENT(cancel_done_block, this, spins);
+				for (uint32_t state = _state.load(); !(state & CancelDoneFlag); state = _state.load())
+					detail::futex_wait(_state, state);
+			}
+		}
+
+		template <typename Token>
+		friend struct cancellation_token_traits;
 	};
 
 
 	namespace detail
 	{
+		template <typename TokenType_>
+		struct cancellation_source_shard_data
+		{
+			std::mutex                               _mutex;
+			detail::intrusive_list<const TokenType_> _tokens;
+			std::atomic<size_t>                      _refs{0}; // references held by tokens created by threads of this shard
+		};
+
+
+		// Shard is padded to two cache lines, since allocation isn't aligned to the cache line boundary
+		template <typename TokenType_>
+		struct cancellation_source_shard : public cancellation_source_shard_data<TokenType_>
+		{
+			char _padding[2 * RETHREAD_CACHE_LINE_SIZE - sizeof(cancellation_source_shard_data<TokenType_>) % RETHREAD_CACHE_LINE_SIZE];
+		};
+
+
+		/// @brief Tokens registry is split into shards selected by the registering thread,
+		///        so tokens of different threads register and unregister under different locks.
+		///        Reference counter is split the same way: tokens count references in shards, while _refs counts the source reference
+		///        and shards with nonzero counters. Any reference is acquired by someone who already holds one,
+		///        so _refs can't spuriously drop to zero.
 		template <typename TokenType_>
 		struct cancellation_source_data
 		{
-			using tokens_intrusive_list = detail::intrusive_list<const TokenType_>;
+			using shard = cancellation_source_shard<TokenType_>;
+			using destroy_func = void (*)(cancellation_source_data*);
+			using create_func = cancellation_source_data* (*)(const cancellation_source_data&);
+
+			static RETHREAD_CONSTEXPR size_t ShardsCount = RETHREAD_SOURCE_SHARDS_COUNT;
+
+			std::atomic<bool>   _cancelled{false};
+			std::atomic<size_t> _refs{1};
+			destroy_func        _destroy{&destroy_default};
+			create_func         _create{&create_default}; // creates a fresh instance that is allocated the same way
+			shard               _shards[ShardsCount];
+
+			static size_t get_shard_index()
+			{ return std::hash<std::thread::id>()(std::this_thread::get_id()) % ShardsCount; }
+
+			shard& get_shard()
+			{ return _shards[get_shard_index()]; }
+
+			void add_ref(size_t shardIndex)
+			{
+				if (_shards[shardIndex]._refs.fetch_add(1, std::memory_order_relaxed) == 0)
+					_refs.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			void release(size_t shardIndex)
+			{
+				if (_shards[shardIndex]._refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					release();
+			}
+
+			void release()
+			{
+				if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					_destroy(this);
+			}
 
-			std::mutex              _mutex;
-			std::condition_variable _cv;
-			bool                    _cancelled{false};
-			bool                    _cancel_done{false};
-			tokens_intrusive_list   _tokens;
+		private:
+			static void destroy_default(cancellation_source_data* data)
+			{ delete data; }
+
+			static cancellation_source_data* create_default(const cancellation_source_data&)
+			{ return new cancellation_source_data(); }
+		};
+
+
+		template <typename TokenType_, typename Allocator_>
+		struct allocated_cancellation_source_data : public cancellation_source_data<TokenType_>
+		{
+			using base = cancellation_source_data<TokenType_>;
+			using allocator_type = typename std::allocator_traits<Allocator_>::template rebind_alloc<allocated_cancellation_source_data>;
+			using allocator_traits = std::allocator_traits<allocator_type>;
+
+			allocator_type _allocator;
+
+			explicit allocated_cancellation_source_data(const allocator_type& allocator) : _allocator(allocator)
+			{
+				this->_destroy = &destroy;
+				this->_create = &create_same;
+			}
+
+			static base* create(const Allocator_& allocator)
+			{
+				allocator_type a(allocator);
+				allocated_cancellation_source_data* result = allocator_traits::allocate(a, 1);
+				return ::new(static_cast<void*>(result)) allocated_cancellation_source_data(a);
+			}
+
+		private:
+			static void destroy(base* data)
+			{
+				allocated_cancellation_source_data* self = static_cast<allocated_cancellation_source_data*>(data);
+				allocator_type a(self->_allocator);
+				self->~allocated_cancellation_source_data();
+				allocator_traits::deallocate(a, self, 1);
+			}
+
+			static base* create_same(const base& data)
+			{ return create(static_cast<const allocated_cancellation_source_data&>(data)._allocator); }
 		};
 	}
 
@@ -253,25 +603,24 @@ namespace rethread
 
 	class sourced_cancellation_token : public cancellation_token, public detail::intrusive_list_node<true>
 	{
-		using data_ptr = std::shared_ptr<detail::cancellation_source_data<sourced_cancellation_token>>;
+		using data = detail::cancellation_source_data<sourced_cancellation_token>;
+		using shard = detail::cancellation_source_shard<sourced_cancellation_token>;
 
-		data_ptr     _data;
-		mutable bool _registered{false};
+		data*                      _data;
+		mutable shard*             _shard{nullptr}; // shard this token is registered in
+		mutable detail::futex_word _cancel_done{0}; // set to 1 when cancel() of this token's handler returns, 2 means there are waiters
+		unsigned char              _ref_shard;      // shard that counts the reference held by this token
 
 	public:
 		sourced_cancellation_token(const sourced_cancellation_token& other) :
-			cancellation_token(not_initialized_invalid_pointer()), intrusive_list_node(), _data(other._data)
+			cancellation_token(not_initialized_invalid_pointer()), intrusive_list_node(), _data(other._data), _ref_shard(acquire(*_data))
 		{ }
 
 		sourced_cancellation_token(sourced_cancellation_token&& other) :
-			cancellation_token(not_initialized_invalid_pointer()), intrusive_list_node(), _data(std::move(other._data))
+			cancellation_token(not_initialized_invalid_pointer()), intrusive_list_node(), _data(other._data), _ref_shard(other._ref_shard)
 		{
-			if (other._registered)
-			{
-				std::unique_lock<std::mutex> l(_data->_mutex);
-				_data->_tokens.erase(other);
-				other._registered = false;
-			}
+			other._data = nullptr;
+			other.unregister_token();
 		}
 
 		sourced_cancellation_token& operator =(const sourced_cancellation_token&) = delete;
@@ -281,121 +630,326 @@ namespace rethread
 			RETHREAD_ASSERT(_cancel_handler.load() == nullptr
 			                || _cancel_handler == not_initialized_invalid_pointer()
 			                || _cancel_handler == cancelled_invalid_pointer(), "Cancellation token is still in use!");
-			if (_registered)
-			{
-				RETHREAD_ASSERT(_data, "Shouldn't be null!");
+			RETHREAD_ASSERT(!_shard || _data, "Shouldn't be null!");
+			unregister_token();
 
-				std::unique_lock<std::mutex> l(_data->_mutex);
-				_data->_tokens.erase(*this);
-			}
+			if (_data)
+				_data->release(_ref_shard);
 		}
 
 	protected:
-		void do_sleep_for(const std::chrono::nanoseconds& duration) const override
+		// Sleeps on its own _cancel_done, which is set for every registered token once the source has finished cancelling it,
+		// so the sleepers of one source don't share a mutex and are woken one by one
+		void do_sleep_for(const std::chrono::nanoseconds& duration) const override final
 		{
-			std::unique_lock<std::mutex> l(_data->_mutex);
-			if (_data->_cancelled)
+			if (is_cancelled()) // registers lazy token in the source
 				return;
 
-			_data->_cv.wait_for(l, duration);
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + duration;
+			for (;;)
+			{
+				uint32_t done = 0;
+				if (!_cancel_done.compare_exchange_strong(done, 2, std::memory_order_acquire) && done == 1)
+					return;
+				const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if (now >= deadline)
+					return;
+				detail::futex_wait_for(_cancel_done, 2, deadline - now);
+			}
 		}
 
-		void unregister_cancellation_handler(cancellation_handler& handler) const override
+		void unregister_cancellation_handler(cancellation_handler& handler) const override final
 		{
 			if (try_unregister_cancellation_handler(handler))
 				return;
 
-			std::unique_lock<std::mutex> l(_data->_mutex);
 			RETHREAD_ASSERT(_data->_cancelled, "Wasn't cancelled!");
 			RETHREAD_ASSERT(_cancel_handler == cancelled_invalid_pointer(), "Wrong _cancel_handler");
+			RETHREAD_INSTRUMENT(unregister_race_lost, this, 1);
 
-			while (!_data->_cancel_done)
-				_data->_cv.wait(l);
+			// Only this token's handler is waited for, not the whole fan-out of the source
+			{
+				RETHREAD_INSTRUMENT_TIMER(timer, cancel_done_wait, this);
+				uint32_t spins = 0;
+				// A timed out sleep leaves 2 in _cancel_done, so only 1 means that the cancel is over
+				if (detail::adaptive_spin<>::spin_until([this] { return _cancel_done.load(std::memory_order_acquire) == 1; }, spins))
+					RETHREAD_INSTRUMENT(cancel_done_spin, this, spins);
+				else
+				{
+					RETHREAD_INSTRUMENT(cancel_done_block, this, spins);
+					wait_cancel_done();
+				}
+			}
 
 			RETHREAD_ANNOTATE_AFTER(std::addressof(handler));
 			RETHREAD_ANNOTATE_FORGET(std::addressof(handler));
-			l.unlock();
 			handler.reset();
 		}
 
-		bool do_initialize() const override
+		bool do_initialize() const override final
 		{
-			RETHREAD_ASSERT(!_registered, "This token is already registered in source!");
-			std::unique_lock<std::mutex> l(_data->_mutex);
-			_data->_tokens.push_back(*this);
-			_registered = true;
+			RETHREAD_ASSERT(!_shard, "This token is already registered in source!");
+			shard& s = _data->get_shard();
+			std::unique_lock<std::mutex> l(s._mutex);
+			s._tokens.push_back(*this);
+			_shard = &s;
+			// cancellation_token_source::cancel() sets _cancelled before visiting shards, so either it will find this token, or we'll see the flag
 			if (!_data->_cancelled)
 				return true;
 
 			_cancel_handler = cancelled_invalid_pointer();
+			bool closed = try_close_empty_callbacks();
+			(void)closed;
+			RETHREAD_ASSERT(closed, "Callbacks shouldn't be registered before initialization!");
+			_cancel_done.store(1, std::memory_order_relaxed);
 			return false;
 		}
 
 	private:
-		sourced_cancellation_token(const data_ptr& data) :
-			cancellation_token(not_initialized_invalid_pointer()), _data(data)
+		sourced_cancellation_token(data& d) :
+			cancellation_token(not_initialized_invalid_pointer()), _data(&d), _ref_shard(acquire(d))
 		{ }
 
-		void cancel_impl(std::unique_lock<std::mutex>& l) const
+		static unsigned char acquire(data& d)
+		{
+			static_assert(data::ShardsCount <= 256, "Shard index should fit unsigned char");
+			size_t index = data::get_shard_index();
+			d.add_ref(index);
+			return static_cast<unsigned char>(index);
+		}
+
+		/// @returns Handler that has to be cancelled, nullptr if there's none
+		cancellation_handler* detach_handler() const
 		{
 			cancellation_handler* cancelHandler = _cancel_handler.exchange(cancelled_invalid_pointer());
 			RETHREAD_ASSERT(cancelHandler != not_initialized_invalid_pointer(), "Token can't be not initialized at this point!");
-			RETHREAD_ASSERT(cancelHandler != cancelled_invalid_pointer(), "_cancelled should protect from double-cancelling");
 
-			if (!cancelHandler)
-				return;
+			// Token could be registered while shard was unlocked, in that case it has already seen _cancelled
+			if (!cancelHandler || cancelHandler == cancelled_invalid_pointer())
+				return nullptr;
 
 			RETHREAD_ANNOTATE_AFTER(std::addressof(_cancel_handler));
 			RETHREAD_ANNOTATE_FORGET(std::addressof(_cancel_handler));
+			return cancelHandler;
+		}
+
+		/// @returns Whether cancel_detached() should be invoked for this token. Closes callbacks list otherwise
+		/// @pre Shard is locked
+		bool needs_cancel_detached(cancellation_handler* cancelHandler) const
+		{
+			if (cancelHandler || !try_close_empty_callbacks())
+				return true;
+			notify_cancel_done(); // nobody can wait for it while the shard is locked
+			return false;
+		}
+
+		/// @note Token may be destroyed as soon as _cancel_done is set, so it shouldn't be accessed afterwards
+		void cancel_detached(cancellation_handler* cancelHandler) const
+		{
+			if (cancelHandler)
+			{
+				{
+					RETHREAD_INSTRUMENT_TIMER(timer, handler_cancel, cancelHandler);
+					cancelHandler->cancel();
+				}
+				RETHREAD_ANNOTATE_BEFORE(cancelHandler);
+			}
+			invoke_callbacks();
+			notify_cancel_done();
+		}
+
+		void notify_cancel_done() const
+		{
+			if (_cancel_done.exchange(1, std::memory_order_release) == 2)
+				detail::futex_wake_all(_cancel_done);
+		}
+
+		void wait_cancel_done() const
+		{
+			uint32_t done = 0;
+			if (!_cancel_done.compare_exchange_strong(done, 2, std::memory_order_acquire) && done == 1)
+				return;
+			while (_cancel_done.load(std::memory_order_acquire) == 2)
+				detail::futex_wait(_cancel_done, 2);
+		}
+
+		void unregister_token() const
+		{
+			if (!_shard)
+				return;
+
+			std::unique_lock<std::mutex> l(_shard->_mutex);
+			// Token without a handler can't wait in unregister_cancellation_handler(), so cancellation_token_source::cancel()
+			// may still be invoking callbacks of this token with the shard unlocked
+			while (_cancel_handler.load() == cancelled_invalid_pointer() && _cancel_done.load(std::memory_order_acquire) != 1)
+			{
+				detail::reverse_lock<std::unique_lock<std::mutex>> ul(l);
+				wait_cancel_done();
+			}
+			_shard->_tokens.erase(*this);
+			_shard = nullptr;
+		}
+
+		void cancel_impl(std::unique_lock<std::mutex>& l) const
+		{
+			cancellation_handler* cancelHandler = detach_handler();
+			if (!needs_cancel_detached(cancelHandler))
+				return;
+
 			{
 				// We have to unlock this mutex because cancel by itself may lock some mutexes, thus leading to deadlock
 				detail::reverse_lock<std::unique_lock<std::mutex>> ul(l);
-				cancelHandler->cancel();
+				if (cancelHandler)
+				{
+					RETHREAD_INSTRUMENT_TIMER(timer, handler_cancel, cancelHandler);
+					cancelHandler->cancel();
+				}
+				invoke_callbacks();
+			}
+			if (cancelHandler)
+			{
+				RETHREAD_ANNOTATE_BEFORE(cancelHandler);
 			}
-			RETHREAD_ANNOTATE_BEFORE(cancelHandler);
+
+			// Mutex is locked back at this point, so the token can't be destroyed and unlinked until the caller moves to the next one
+			notify_cancel_done();
 		}
 
 		friend class cancellation_token_source;
+
+		template <typename Token>
+		friend struct cancellation_token_traits;
+	};
+
+
+	enum class cancellation_fan_out
+	{
+		sequential, ///< Handlers are cancelled one by one while visiting the registry
+		batched,    ///< Handlers are collected in one pass over the registry, and then cancelled without touching the registry
+		parallel    ///< Collected handlers are split between several threads
 	};
 
 
 	class cancellation_token_source
 	{
 		using data = detail::cancellation_source_data<sourced_cancellation_token>;
-		using data_ptr = std::shared_ptr<data>;
 
-		data_ptr _data;
+		data* _data;
 
 	public:
-		cancellation_token_source() : _data(std::make_shared<data>())
+		cancellation_token_source() : _data(new data())
+		{ }
+
+		/// @brief Allocates shared state using the provided allocator, e.g. from a pool or an arena
+		template <typename Allocator>
+		explicit cancellation_token_source(const Allocator& allocator) :
+			_data(detail::allocated_cancellation_source_data<sourced_cancellation_token, Allocator>::create(allocator))
 		{ }
 
 		cancellation_token_source(const cancellation_token_source&) = delete;
 		cancellation_token_source& operator =(const cancellation_token_source&) = delete;
 
 		~cancellation_token_source()
-		{ cancel(); }
+		{
+			cancel();
+			_data->release();
+		}
 
 		void cancel()
+		{ cancel(cancellation_fan_out::sequential); }
+
+		/// @param threads Number of threads (including the calling one) for cancellation_fan_out::parallel. Zero means hardware concurrency
+		/// @note Each extra thread gets at least RETHREAD_PARALLEL_CANCEL_HANDLERS_PER_THREAD handlers, smaller sources are cancelled inline
+		void cancel(cancellation_fan_out fanOut, unsigned threads = 0)
 		{
-			std::unique_lock<std::mutex> l(_data->_mutex);
-			if (_data->_cancelled)
+			if (_data->_cancelled.exchange(true))
 				return;
 
-			_data->_cancelled = true;
-
-			for (const sourced_cancellation_token& token : _data->_tokens)
-				token.cancel_impl(l); // cancel_impl will unlock mutex before calling cancel()
-
-			_data->_cancel_done = true;
-			_data->_cv.notify_all();
+			RETHREAD_INSTRUMENT_TIMER(timer, source_cancel, this);
+			size_t tokensCount = 0;
+			if (fanOut == cancellation_fan_out::sequential)
+				for (data::shard& shard : _data->_shards)
+				{
+					std::unique_lock<std::mutex> l(shard._mutex);
+					for (const sourced_cancellation_token& token : shard._tokens)
+					{
+						token.cancel_impl(l); // cancel_impl will unlock mutex before calling cancel()
+						++tokensCount;
+					}
+				}
+			else
+				cancel_collected(collect_handlers(tokensCount), fanOut == cancellation_fan_out::parallel ? threads : 1);
+			RETHREAD_INSTRUMENT(source_tokens, this, tokensCount);
+			(void)tokensCount;
 		}
 
 		void reset()
-		{ _data = std::make_shared<data>(); }
+		{
+			data* d = _data->_create(*_data);
+			_data->release();
+			_data = d;
+		}
 
 		sourced_cancellation_token create_token()
-		{ return sourced_cancellation_token(_data); }
+		{ return sourced_cancellation_token(*_data); }
+
+	private:
+		using pending_handler = std::pair<const sourced_cancellation_token*, cancellation_handler*>;
+		using pending_handlers = std::vector<pending_handler>;
+
+		// Collected tokens stay alive - their owners can't unregister handlers or destroy tokens until cancel_detached() is invoked
+		pending_handlers collect_handlers(size_t& tokensCount)
+		{
+			pending_handlers result;
+			for (data::shard& shard : _data->_shards)
+			{
+				std::unique_lock<std::mutex> l(shard._mutex);
+				for (const sourced_cancellation_token& token : shard._tokens)
+				{
+					cancellation_handler* handler = token.detach_handler();
+					if (token.needs_cancel_detached(handler))
+						result.push_back(pending_handler(&token, handler));
+					++tokensCount;
+				}
+			}
+			return result;
+		}
+
+		static void cancel_collected(const pending_handlers& handlers, unsigned threads)
+		{
+			if (threads == 0)
+				threads = std::max(std::thread::hardware_concurrency(), 1u);
+			const size_t perThread = RETHREAD_PARALLEL_CANCEL_HANDLERS_PER_THREAD;
+			threads = static_cast<unsigned>(std::max<size_t>(std::min<size_t>(threads, handlers.size() / std::max<size_t>(perThread, 1)), 1));
+
+			// Handlers are detached already, so if a helper can't be spawned its stride is cancelled by this thread
+			std::vector<std::thread> helpers;
+			unsigned spawned = 1;
+#ifdef RETHREAD_HAS_EXCEPTIONS
+			try
+#endif
+			{
+				helpers.reserve(threads - 1);
+				for (; spawned < threads; ++spawned)
+					helpers.emplace_back(&cancellation_token_source::cancel_stride, std::cref(handlers), spawned, threads);
+			}
+#ifdef RETHREAD_HAS_EXCEPTIONS
+			catch (...)
+			{ }
+#endif
+			cancel_stride(handlers, 0, threads);
+			for (unsigned i = spawned; i < threads; ++i)
+				cancel_stride(handlers, i, threads);
+
+			for (std::thread& helper : helpers)
+				helper.join();
+		}
+
+		static void cancel_stride(const pending_handlers& handlers, size_t first, size_t step)
+		{
+			for (size_t i = first; i < handlers.size(); i += step)
+				handlers[i].first->cancel_detached(handlers[i].second);
+		}
 	};
 
 
@@ -413,36 +967,97 @@ namespace rethread
 	};
 
 
-	class cancellation_guard : public cancellation_guard_base
+	/// @brief Dispatches token operations by the static type of the token. Concrete tokens have final overrides,
+	///        so their slow paths are called directly and can be inlined into the cancellable function
+	template <typename Token>
+	struct cancellation_token_traits
 	{
-	private:
-		const cancellation_token* _token;
-		cancellation_handler*     _handler;
+		static_assert(std::is_base_of<cancellation_token, Token>::value, "Token should be derived from cancellation_token");
+
+		/// @brief If false, cancellable function can be replaced with the plain one at compile time
+		static RETHREAD_CONSTEXPR bool can_be_cancelled = true;
+
+		static bool is_cancelled(const Token& token)
+		{ return token.is_cancelled(); }
+
+		static bool try_register(const Token& token, cancellation_handler& handler)
+		{ return token.try_register_cancellation_handler(handler); }
+
+		static bool try_unregister(const Token& token, cancellation_handler& handler)
+		{ return token.try_unregister_cancellation_handler(handler); }
+
+		static void unregister(const Token& token, cancellation_handler& handler)
+		{ token.unregister_cancellation_handler(handler); }
+
+		static void sleep_for(const Token& token, const std::chrono::nanoseconds& duration)
+		{ token.do_sleep_for(duration); }
+	};
+
+
+	/// @brief Dummy token is never cancelled, so its handler slot is not touched at all
+	template <>
+	struct cancellation_token_traits<dummy_cancellation_token>
+	{
+		static RETHREAD_CONSTEXPR bool can_be_cancelled = false;
+
+		static bool is_cancelled(const dummy_cancellation_token&)
+		{ return false; }
+
+		static bool try_register(const dummy_cancellation_token&, cancellation_handler&)
+		{ return true; }
+
+		static bool try_unregister(const dummy_cancellation_token&, cancellation_handler&)
+		{ return true; }
+
+		static void unregister(const dummy_cancellation_token&, cancellation_handler&)
+		{ }
+
+		static void sleep_for(const dummy_cancellation_token&, const std::chrono::nanoseconds& duration)
+		{ std::this_thread::sleep_for(duration); }
+	};
+
+
+	namespace detail
+	{
+		template <typename Token, typename Result_ = void>
+		struct enable_if_token : public std::enable_if<std::is_base_of<cancellation_token, Token>::value, Result_>
+		{ };
+	}
+
+
+	/// @brief Keeps the handler registered for the lifetime of the guard. Token type is preserved, see cancellation_token_traits
+	template <typename Token>
+	class basic_cancellation_guard
+	{
+		using traits = cancellation_token_traits<Token>;
+
+		const Token*          _token;
+		cancellation_handler* _handler;
 
 	public:
-		cancellation_guard(const cancellation_guard&) = delete;
-		cancellation_guard& operator =(const cancellation_guard&) = delete;
+		basic_cancellation_guard(const basic_cancellation_guard&) = delete;
+		basic_cancellation_guard& operator =(const basic_cancellation_guard&) = delete;
 
-		cancellation_guard() :
+		basic_cancellation_guard() :
 			_token(nullptr), _handler(nullptr)
 		{ }
 
-		cancellation_guard(const cancellation_token& token, cancellation_handler& handler) :
+		basic_cancellation_guard(const Token& token, cancellation_handler& handler) :
 			_token(nullptr), _handler(&handler)
 		{
-			if (try_register(token, handler))
+			if (traits::try_register(token, handler))
 				_token = &token;
 		}
 
-		cancellation_guard(cancellation_guard&& other) :
+		basic_cancellation_guard(basic_cancellation_guard&& other) :
 			_token(other._token), _handler(other._handler)
 		{ other._token = nullptr; }
 
-		~cancellation_guard()
+		~basic_cancellation_guard()
 		{
-			if (!_token || RETHREAD_LIKELY(try_unregister(*_token, *_handler)))
+			if (!_token || RETHREAD_LIKELY(traits::try_unregister(*_token, *_handler)))
 				return;
-			unregister(*_token, *_handler);
+			traits::unregister(*_token, *_handler);
 		}
 
 		bool is_cancelled() const
@@ -450,6 +1065,9 @@ namespace rethread
 	};
 
 
+	using cancellation_guard = basic_cancellation_guard<cancellation_token>;
+
+
 	class chain_cancellation_tokens
 	{
 		class impl : public cancellation_handler
@@ -489,6 +1107,61 @@ namespace rethread
 			_impl(destination), _guard(source, _impl)
 		{ }
 	};
+
+
+	namespace detail
+	{
+		/// @brief Cancels the target token when the parent is cancelled
+		class cancellation_link : public cancellation_callback_base
+		{
+			standalone_cancellation_token* _target{nullptr};
+
+		public:
+			cancellation_link() = default;
+
+			~cancellation_link()
+			{ unregister_callback(); }
+
+			void attach(standalone_cancellation_token& target, const cancellation_token& parent)
+			{
+				_target = &target;
+				register_callback(parent);
+			}
+
+		private:
+			void invoke() override
+			{ _target->cancel(); }
+		};
+	}
+
+
+	/// @brief Token that is cancelled as soon as any of up to MaxParents parent tokens is cancelled, or if cancel() is invoked.
+	///        Parents are observed directly by callbacks stored inline, so there are no intermediate tokens, and cancelling
+	///        a parent costs a single callback on top of cancelling this token.
+	/// @note  Parents should outlive this token
+	template <size_t MaxParents>
+	class linked_cancellation_token : public standalone_cancellation_token
+	{
+		static_assert(MaxParents > 0, "linked_cancellation_token needs at least one parent");
+
+		detail::cancellation_link _links[MaxParents];
+
+	public:
+		template <typename... Tokens>
+		explicit linked_cancellation_token(const Tokens&... parents)
+		{
+			static_assert(sizeof...(Tokens) > 0 && sizeof...(Tokens) <= MaxParents, "Wrong number of parents");
+			size_t i = 0;
+			int dummy[] = { (_links[i++].attach(*this, parents), 0)... };
+			(void)dummy;
+		}
+
+		linked_cancellation_token(const linked_cancellation_token&) = delete;
+		linked_cancellation_token& operator =(const linked_cancellation_token&) = delete;
+
+		// Links are destroyed before the base class, so that parents can't cancel a destroyed token
+		~linked_cancellation_token() = default;
+	};
 }
 
 #endif
@@ -0,0 +1,302 @@
+#ifndef RETHREAD_CONCURRENT_QUEUE_HPP
+#define RETHREAD_CONCURRENT_QUEUE_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/condition_variable.hpp>
+#include <rethread/detail/config.hpp>
+#include <rethread/detail/spin.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace rethread
+{
+	/// @brief Unbounded MPMC queue with cancellable pop().
+	///        Element count is mirrored to an atomic, which pop() checks (and briefly spins on) before taking the mutex.
+	///        So an element that arrives soon is taken without blocking or registering a cancellation handler,
+	///        and push() doesn't touch the condition variable unless someone is waiting. Taking the element itself locks the mutex.
+	/// @note  All blocked consumers share one condition variable, so the first cancelled handler wakes all of them.
+	///        Those whose tokens are cancelled too leave at once, without waiting for their own handlers.
+	template <typename T>
+	class concurrent_queue
+	{
+		std::mutex              _mutex;
+		std::deque<T>           _queue;
+		std::condition_variable _cv;
+		std::atomic<size_t>     _size{0};
+		std::atomic<size_t>     _waiters{0};
+
+	public:
+		concurrent_queue() = default;
+		concurrent_queue(const concurrent_queue&) = delete;
+		concurrent_queue& operator = (const concurrent_queue&) = delete;
+
+		void push(const T& value)
+		{ emplace(value); }
+
+		void push(T&& value)
+		{ emplace(std::move(value)); }
+
+		template <typename... Args>
+		void emplace(Args&&... args)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_queue.emplace_back(std::forward<Args>(args)...);
+			_size.store(_queue.size(), std::memory_order_relaxed);
+			if (_waiters.load(std::memory_order_relaxed) != 0) // modified under the same mutex
+				_cv.notify_one();
+		}
+
+		bool try_pop(T& value)
+		{
+			if (_size.load(std::memory_order_relaxed) == 0)
+				return false;
+
+			std::unique_lock<std::mutex> l(_mutex);
+			return try_pop_locked(value);
+		}
+
+		/// @returns False if cancelled
+		bool pop(T& value, const cancellation_token& token)
+		{
+			uint32_t spins = 0;
+			if (detail::adaptive_spin<concurrent_queue>::spin_until([this] { return _size.load(std::memory_order_relaxed) != 0; }, spins) && try_pop(value))
+				return true;
+
+			std::unique_lock<std::mutex> l(_mutex);
+			if (try_pop_locked(value))
+				return true;
+
+			++_waiters;
+			bool result = rethread::wait(_cv, l, token, [&] { return this->try_pop_locked(value); });
+			--_waiters;
+			return result;
+		}
+
+		bool empty() const
+		{ return _size.load(std::memory_order_relaxed) == 0; }
+
+		size_t size() const
+		{ return _size.load(std::memory_order_relaxed); }
+
+	private:
+		bool try_pop_locked(T& value)
+		{
+			if (_queue.empty())
+				return false;
+
+			value = std::move(_queue.front());
+			_queue.pop_front();
+			_size.store(_queue.size(), std::memory_order_relaxed);
+			return true;
+		}
+	};
+
+
+	/// @brief Bounded MPMC queue of fixed capacity, with cancellable push() and pop().
+	///        try_push() and try_pop() are lock-free (array-based queue by Dmitry Vyukov). Blocking operations fall back to a mutex
+	///        and condition variables only when the queue is full or empty, and wake-ups are skipped when nobody waits.
+	/// @note  Same as concurrent_queue, the first cancelled handler wakes all blocked consumers (or producers)
+	template <typename T>
+	class bounded_concurrent_queue
+	{
+		struct cell
+		{
+			std::atomic<size_t>                                                          _sequence;
+			typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type _storage;
+
+			T* get()
+			{ return reinterpret_cast<T*>(&_storage); }
+		};
+
+		std::unique_ptr<cell[]> _cells;
+		size_t                  _mask;
+		char                    _padding0[RETHREAD_CACHE_LINE_SIZE];
+		std::atomic<size_t>     _push_pos{0};
+		char                    _padding1[RETHREAD_CACHE_LINE_SIZE];
+		std::atomic<size_t>     _pop_pos{0};
+		char                    _padding2[RETHREAD_CACHE_LINE_SIZE];
+		std::atomic<size_t>     _push_waiters{0};
+		std::atomic<size_t>     _pop_waiters{0};
+		std::mutex              _mutex;
+		std::condition_variable _not_full;
+		std::condition_variable _not_empty;
+
+	public:
+		/// @param capacity Is rounded up to a power of two
+		explicit bounded_concurrent_queue(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size *= 2;
+
+			_cells.reset(new cell[size]);
+			_mask = size - 1;
+			for (size_t i = 0; i < size; ++i)
+				_cells[i]._sequence.store(i, std::memory_order_relaxed);
+		}
+
+		bounded_concurrent_queue(const bounded_concurrent_queue&) = delete;
+		bounded_concurrent_queue& operator = (const bounded_concurrent_queue&) = delete;
+
+		~bounded_concurrent_queue()
+		{
+			for (size_t pos = _pop_pos.load(); pos != _push_pos.load(); ++pos)
+				_cells[pos & _mask].get()->~T();
+		}
+
+		size_t capacity() const
+		{ return _mask + 1; }
+
+		bool try_push(const T& value)
+		{ return try_push_notify(value); }
+
+		bool try_push(T&& value)
+		{ return try_push_notify(std::move(value)); }
+
+		bool try_pop(T& value)
+		{
+			if (!try_pop_impl(value))
+				return false;
+			notify(_push_waiters, _not_full);
+			return true;
+		}
+
+		/// @returns False if cancelled. In this case value is left intact
+		bool push(const T& value, const cancellation_token& token)
+		{ return push_impl(value, token); }
+
+		/// @returns False if cancelled. In this case value is left intact
+		bool push(T&& value, const cancellation_token& token)
+		{ return push_impl(std::move(value), token); }
+
+		/// @returns False if cancelled
+		bool pop(T& value, const cancellation_token& token)
+		{
+			if (try_pop(value))
+				return true;
+
+			bool result = false;
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				_pop_waiters.fetch_add(1);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				result = rethread::wait(_not_empty, l, token, [&] { return this->try_pop_impl(value); });
+				_pop_waiters.fetch_sub(1, std::memory_order_relaxed);
+			}
+			if (result)
+				notify(_push_waiters, _not_full);
+			return result;
+		}
+
+	private:
+		template <typename U>
+		bool try_push_notify(U&& value)
+		{
+			if (!try_push_impl(std::forward<U>(value)))
+				return false;
+			notify(_pop_waiters, _not_empty);
+			return true;
+		}
+
+		template <typename U>
+		bool push_impl(U&& value, const cancellation_token& token)
+		{
+			if (try_push_notify(std::forward<U>(value)))
+				return true;
+
+			bool result = false;
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				_push_waiters.fetch_add(1);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				// try_push_impl() moves from value only if it succeeds
+				result = rethread::wait(_not_full, l, token, [&] { return this->try_push_impl(std::forward<U>(value)); });
+				_push_waiters.fetch_sub(1, std::memory_order_relaxed);
+			}
+			if (result)
+				notify(_pop_waiters, _not_empty);
+			return result;
+		}
+
+		// Waiter increments the counter and then checks the queue, while the notifier changes the queue and then checks the counter,
+		// so at least one of them sees the other
+		void notify(std::atomic<size_t>& waiters, std::condition_variable& cv)
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (RETHREAD_LIKELY(waiters.load(std::memory_order_relaxed) == 0))
+				return;
+
+			std::unique_lock<std::mutex> l(_mutex);
+			cv.notify_one();
+		}
+
+		template <typename U>
+		bool try_push_impl(U&& value)
+		{
+			size_t pos = _push_pos.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				cell& c = _cells[pos & _mask];
+				std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(c._sequence.load(std::memory_order_acquire) - pos);
+				if (diff == 0)
+				{
+					if (_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						::new(static_cast<void*>(c.get())) T(std::forward<U>(value));
+						c._sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false; // full
+				else
+					pos = _push_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		bool try_pop_impl(T& value)
+		{
+			size_t pos = _pop_pos.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				cell& c = _cells[pos & _mask];
+				std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(c._sequence.load(std::memory_order_acquire) - (pos + 1));
+				if (diff == 0)
+				{
+					if (_pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						value = std::move(*c.get());
+						c.get()->~T();
+						c._sequence.store(pos + _mask + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false; // empty
+				else
+					pos = _pop_pos.load(std::memory_order_relaxed);
+			}
+		}
+	};
+}
+
+#endif
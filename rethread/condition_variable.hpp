@@ -55,31 +55,33 @@ namespace rethread
 		};
 
 
-		template<typename Handler>
-		class cv_cancellation_guard : public cancellation_guard_base
+		template<typename Handler, typename Token>
+		class cv_cancellation_guard
 		{
-			const cancellation_token& _token;
-			Handler&                  _handler;
-			bool                      _registered;
+			using traits = cancellation_token_traits<Token>;
+
+			const Token& _token;
+			Handler&     _handler;
+			bool         _registered;
 
 		public:
 			cv_cancellation_guard(const cv_cancellation_guard&) = delete;
 			cv_cancellation_guard& operator = (const cv_cancellation_guard&) = delete;
 
-			cv_cancellation_guard(const cancellation_token& token, Handler& handler) :
+			cv_cancellation_guard(const Token& token, Handler& handler) :
 				_token(token), _handler(handler)
-			{ _registered = try_register(_token, _handler); }
+			{ _registered = traits::try_register(_token, _handler); }
 
 			~cv_cancellation_guard()
 			{
-				if (!_registered || RETHREAD_LIKELY(try_unregister(_token, _handler)))
+				if (!_registered || RETHREAD_LIKELY(traits::try_unregister(_token, _handler)))
 					return;
 
 				// We need to unlock mutex before unregistering, because canceller thread
 				// can get stuck at mutex in cv_cancellation_handler::cancel().
 				// When unregister returns, we are sure that canceller has left cancel(), so it is safe to lock mutex back.
 				reverse_lock<typename Handler::lock_type> ul(_handler.get_lock());
-				unregister(_token, _handler);
+				traits::unregister(_token, _handler);
 			}
 
 			bool is_cancelled() const
@@ -88,34 +90,38 @@ namespace rethread
 	}
 
 
-	template<typename Condition, typename Lock>
-	void wait(Condition& cv, Lock& lock, const cancellation_token& token)
+	// Token type is a template parameter, so that dummy_cancellation_token compiles down to the plain wait, and concrete tokens
+	// are dispatched statically. See cancellation_token_traits
+
+
+	template<typename Condition, typename Lock, typename Token>
+	typename detail::enable_if_token<Token>::type wait(Condition& cv, Lock& lock, const Token& token)
 	{
 		using handler_type = detail::cv_cancellation_handler<Condition, Lock>;
 		handler_type handler(cv, lock);
-		detail::cv_cancellation_guard<handler_type> guard(token, handler);
+		detail::cv_cancellation_guard<handler_type, Token> guard(token, handler);
 		if (guard.is_cancelled())
 			return;
 		cv.wait(lock);
 	}
 
 
-	template<typename Condition, typename Lock, typename Predicate>
-	bool wait(Condition& cv, Lock& lock, const cancellation_token& token, Predicate predicate)
+	template<typename Condition, typename Lock, typename Token, typename Predicate>
+	typename detail::enable_if_token<Token, bool>::type wait(Condition& cv, Lock& lock, const Token& token, Predicate predicate)
 	{
 		if (predicate()) // registering handler is not free, so it makes sense to check predicate
 			return true;
 
 		using handler_type = detail::cv_cancellation_handler<Condition, Lock>;
 		handler_type handler(cv, lock);
-		detail::cv_cancellation_guard<handler_type> guard(token, handler);
+		detail::cv_cancellation_guard<handler_type, Token> guard(token, handler);
 		if (guard.is_cancelled())
 			return false;
 
 		cv.wait(lock);
 		while (!predicate())
 		{
-			if (!token)
+			if (cancellation_token_traits<Token>::is_cancelled(token))
 				return false;
 			cv.wait(lock);
 		}
@@ -123,58 +129,58 @@ namespace rethread
 	}
 
 
-	template<typename Condition, typename Lock, typename TimePoint>
-	std::cv_status wait_until(Condition& cv, Lock& lock, TimePoint&& time_point, const cancellation_token& token)
+	template<typename Condition, typename Lock, typename TimePoint, typename Token>
+	typename detail::enable_if_token<Token, std::cv_status>::type wait_until(Condition& cv, Lock& lock, TimePoint&& time_point, const Token& token)
 	{
 		using handler_type = detail::cv_cancellation_handler<Condition, Lock>;
 		handler_type handler(cv, lock);
-		detail::cv_cancellation_guard<handler_type> guard(token, handler);
+		detail::cv_cancellation_guard<handler_type, Token> guard(token, handler);
 		if (guard.is_cancelled())
 			return std::cv_status::no_timeout;
-		return cv.wait_until(lock, std::forward(time_point));
+		return cv.wait_until(lock, time_point);
 	}
 
 
-	template<typename Condition, typename Lock, typename TimePoint, typename Predicate>
-	bool wait_until(Condition& cv, Lock& lock, TimePoint&& time_point, const cancellation_token& token, Predicate predicate)
+	template<typename Condition, typename Lock, typename TimePoint, typename Token, typename Predicate>
+	typename detail::enable_if_token<Token, bool>::type wait_until(Condition& cv, Lock& lock, TimePoint&& time_point, const Token& token, Predicate predicate)
 	{
 		if (predicate()) // registering handler is not free, so it makes sense to check predicate
 			return true;
 
 		using handler_type = detail::cv_cancellation_handler<Condition, Lock>;
 		handler_type handler(cv, lock);
-		detail::cv_cancellation_guard<handler_type> guard(token, handler);
+		detail::cv_cancellation_guard<handler_type, Token> guard(token, handler);
 		if (guard.is_cancelled())
 			return false;
 
-		if (cv.wait_until(lock, std::forward(time_point)) == std::cv_status::no_timeout)
+		if (cv.wait_until(lock, time_point) == std::cv_status::timeout)
 			return predicate();
 
 		while (!predicate())
 		{
-			if (!token)
+			if (cancellation_token_traits<Token>::is_cancelled(token))
 				return false;
-			if (cv.wait_until(lock, std::forward(time_point)) == std::cv_status::no_timeout)
+			if (cv.wait_until(lock, time_point) == std::cv_status::timeout)
 				return predicate();
 		}
 		return true;
 	}
 
 
-	template<typename Condition, typename Lock, typename Duration>
-	std::cv_status wait_for(Condition& cv, Lock& lock, Duration&& duration, const cancellation_token& token)
+	template<typename Condition, typename Lock, typename Duration, typename Token>
+	typename detail::enable_if_token<Token, std::cv_status>::type wait_for(Condition& cv, Lock& lock, Duration&& duration, const Token& token)
 	{
 		using handler_type = detail::cv_cancellation_handler<Condition, Lock>;
 		handler_type handler(cv, lock);
-		detail::cv_cancellation_guard<handler_type> guard(token, handler);
+		detail::cv_cancellation_guard<handler_type, Token> guard(token, handler);
 		if (guard.is_cancelled())
 			return std::cv_status::no_timeout;
-		return cv.wait_for(lock, std::forward(duration));
+		return cv.wait_for(lock, duration);
 	}
 
 
-	template<typename Condition, typename Lock, typename Duration, typename Predicate>
-	bool wait_for(Condition& cv, Lock& lock, Duration&& duration, const cancellation_token& token, Predicate predicate)
+	template<typename Condition, typename Lock, typename Duration, typename Token, typename Predicate>
+	typename detail::enable_if_token<Token, bool>::type wait_for(Condition& cv, Lock& lock, Duration&& duration, const Token& token, Predicate predicate)
 	{ return wait_until(cv, lock, std::chrono::steady_clock::now() + duration, token, std::move(predicate)); }
 
 }
@@ -0,0 +1,272 @@
+#ifndef RETHREAD_COROUTINE_HPP
+#define RETHREAD_COROUTINE_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/detail/config.hpp>
+
+#ifdef RETHREAD_HAS_COROUTINES
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/deadline_cancellation_token.hpp>
+#include <rethread/detail/timer_wheel.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+
+namespace rethread
+{
+	namespace detail
+	{
+		/// @brief Decides who resumes the coroutine. Completion may come from several threads (e.g. the timer and the cancellation),
+		///        and even before await_suspend() finishes. Only the first completion counts, and if it comes before the coroutine
+		///        is suspended, await_suspend() returns false instead of resuming it recursively.
+		/// @note  Owner should make sure that all completion sources are detached before the resumer is destroyed
+		class coroutine_resumer
+		{
+			static RETHREAD_CONSTEXPR uint64_t Idle = 0;
+			static RETHREAD_CONSTEXPR uint64_t Suspended = 1;
+			static RETHREAD_CONSTEXPR uint64_t Completed = 2; // result is stored in the upper bits
+
+			std::coroutine_handle<> _handle;
+			std::atomic<uint64_t>   _state{Idle};
+
+		public:
+			void set_handle(std::coroutine_handle<> handle)
+			{ _handle = handle; }
+
+			/// @returns False if already completed, so that the coroutine should go on without suspending
+			bool suspend()
+			{
+				uint64_t expected = Idle;
+				return _state.compare_exchange_strong(expected, Suspended, std::memory_order_acq_rel);
+			}
+
+			/// @brief   Result is published together with the completion, so that it's consistent with the winner
+			/// @returns True for the first completion
+			bool try_complete(uint32_t result)
+			{
+				uint64_t state = complete(result);
+				if (state & Completed)
+					return false;
+				if (state == Suspended)
+					_handle.resume(); // the resumed coroutine may destroy the owner of *this right away
+				return true;
+			}
+
+			/// @brief   Completes without resuming, for the callers that can't let the coroutine run in their call stack
+			/// @returns True if the completion is the first one and the coroutine is already suspended, so the caller should resume() it
+			bool try_complete_deferred(uint32_t result)
+			{ return complete(result) == Suspended; }
+
+			void resume()
+			{ _handle.resume(); }
+
+			bool is_completed() const
+			{ return (_state.load(std::memory_order_acquire) & Completed) != 0; }
+
+			uint32_t get_result() const
+			{ return static_cast<uint32_t>(_state.load(std::memory_order_acquire) >> 2); }
+
+		private:
+			/// @returns Previous state, it has Completed bit set if someone else has completed first
+			uint64_t complete(uint32_t result)
+			{
+				uint64_t state = _state.load(std::memory_order_relaxed);
+				while (!(state & Completed))
+					if (_state.compare_exchange_weak(state, Completed | (static_cast<uint64_t>(result) << 2), std::memory_order_acq_rel))
+						break;
+				return state;
+			}
+		};
+
+
+		/// @brief Resumes a cancelled coroutine in the timer service thread. Cancelling thread still uses the token after
+		///        the callbacks return, so if the coroutine was resumed right there, it couldn't destroy its own token
+		class coroutine_resume_task : public timer_wheel_entry
+		{
+			coroutine_resumer& _resumer;
+			timer_service&     _service;
+
+		public:
+			coroutine_resume_task(coroutine_resumer& resumer, timer_service& service) : _resumer(resumer), _service(service)
+			{ }
+
+			~coroutine_resume_task()
+			{ _service.disarm(*this); }
+
+			coroutine_resume_task(const coroutine_resume_task&) = delete;
+			coroutine_resume_task& operator = (const coroutine_resume_task&) = delete;
+
+			void post(uint32_t result)
+			{
+				if (_resumer.try_complete_deferred(result))
+					_service.post(*this);
+			}
+
+		private:
+			void expire() override
+			{ _resumer.resume(); }
+		};
+
+
+		/// @brief Notifies the owner once the token is cancelled. Callbacks, unlike cancellation handlers,
+		///        may be unregistered from the invocation itself, but the token may not be destroyed there,
+		///        so the owner should resume the coroutine elsewhere
+		template <typename Owner_>
+		class coroutine_cancellation_callback : public cancellation_callback_base
+		{
+			Owner_* _owner{nullptr};
+
+		public:
+			~coroutine_cancellation_callback()
+			{ unregister_callback(); }
+
+			void attach(Owner_& owner, const cancellation_token& token)
+			{
+				_owner = &owner;
+				register_callback(token);
+			}
+
+			void detach()
+			{ unregister_callback(); }
+
+		private:
+			void invoke() override
+			{ _owner->on_cancelled(); }
+		};
+	}
+
+
+	/// @brief co_await on a token suspends the coroutine until the token is cancelled.
+	///        It's resumed by the timer service thread, so that the coroutine may destroy the token right away
+	class token_awaiter
+	{
+		friend class detail::coroutine_cancellation_callback<token_awaiter>;
+
+		const cancellation_token&                              _token;
+		detail::coroutine_resumer                              _resumer;
+		detail::coroutine_resume_task                          _resume_task;
+		detail::coroutine_cancellation_callback<token_awaiter> _callback;
+
+	public:
+		explicit token_awaiter(const cancellation_token& token, timer_service& service = timer_service::get_default()) :
+			_token(token), _resume_task(_resumer, service)
+		{ }
+
+		token_awaiter(const token_awaiter&) = delete;
+		token_awaiter& operator = (const token_awaiter&) = delete;
+
+		bool await_ready() const
+		{ return _token.is_cancelled(); }
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			_resumer.set_handle(handle);
+			_callback.attach(*this, _token);
+			return _resumer.suspend();
+		}
+
+		void await_resume()
+		{ }
+
+	private:
+		void on_cancelled()
+		{ _resume_task.post(0); }
+	};
+
+
+	inline token_awaiter operator co_await(const cancellation_token& token)
+	{ return token_awaiter(token); }
+
+
+	/// @brief Cancellable coroutine sleep on a timer_service. Doesn't block any thread.
+	///        The coroutine is resumed by the timer service thread either way, so the code after co_await
+	///        should hand heavy work over to some executor
+	class sleep_awaiter
+	{
+		friend class detail::coroutine_cancellation_callback<sleep_awaiter>;
+
+		class timer : public detail::timer_wheel_entry
+		{
+			sleep_awaiter& _owner;
+
+		public:
+			explicit timer(sleep_awaiter& owner) : _owner(owner)
+			{ }
+
+			void expire() override
+			{ _owner._resumer.try_complete(1); }
+		};
+
+		using clock = timer_service::clock;
+
+		const cancellation_token&                              _token;
+		timer_service&                                         _service;
+		clock::time_point                                      _deadline;
+		detail::coroutine_resumer                              _resumer;
+		timer                                                  _timer;
+		detail::coroutine_resume_task                          _resume_task;
+		detail::coroutine_cancellation_callback<sleep_awaiter> _callback;
+
+	public:
+		sleep_awaiter(clock::time_point deadline, const cancellation_token& token, timer_service& service) :
+			_token(token), _service(service), _deadline(deadline), _timer(*this), _resume_task(_resumer, service)
+		{ }
+
+		~sleep_awaiter()
+		{
+			_service.disarm(_timer);
+			_callback.detach();
+		}
+
+		sleep_awaiter(const sleep_awaiter&) = delete;
+		sleep_awaiter& operator = (const sleep_awaiter&) = delete;
+
+		bool await_ready() const
+		{ return _token.is_cancelled(); }
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			_resumer.set_handle(handle);
+			_service.arm(_timer, _deadline);
+			_callback.attach(*this, _token);
+			return _resumer.suspend();
+		}
+
+		/// @returns False if cancelled
+		bool await_resume() const
+		{ return _resumer.get_result() != 0; }
+
+	private:
+		void on_cancelled()
+		{ _resume_task.post(0); }
+	};
+
+
+	namespace this_coroutine
+	{
+		/// @brief co_await sleep_until(deadline, token) returns false if cancelled
+		inline sleep_awaiter sleep_until(timer_service::clock::time_point deadline, const cancellation_token& token, timer_service& service = timer_service::get_default())
+		{ return sleep_awaiter(deadline, token, service); }
+
+		/// @brief co_await sleep_for(duration, token) returns false if cancelled
+		template <typename Rep_, typename Period_>
+		sleep_awaiter sleep_for(const std::chrono::duration<Rep_, Period_>& duration, const cancellation_token& token, timer_service& service = timer_service::get_default())
+		{ return sleep_awaiter(timer_service::clock::now() + std::chrono::duration_cast<timer_service::clock::duration>(duration), token, service); }
+	}
+}
+
+#endif
+
+#endif
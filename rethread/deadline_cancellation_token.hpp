@@ -0,0 +1,206 @@
+#ifndef RETHREAD_DEADLINE_CANCELLATION_TOKEN_HPP
+#define RETHREAD_DEADLINE_CANCELLATION_TOKEN_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/condition_variable.hpp>
+#include <rethread/thread.hpp>
+#include <rethread/detail/timer_wheel.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+
+namespace rethread
+{
+	/// @brief Background thread that expires timers of a shared hierarchical timer wheel.
+	///        Arming and disarming a timer is O(1) and doesn't read the clock. The thread sleeps until the nearest tick that has
+	///        something to do, and is woken only if a timer that expires earlier gets armed.
+	/// @note  Timers are expired in the service thread, so expire() should be short
+	class timer_service
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+		using entry = detail::timer_wheel_entry;
+
+	private:
+		std::mutex                        _mutex;
+		std::condition_variable           _cv;         // wakes the service thread
+		std::condition_variable           _expired_cv; // wakes those who wait in disarm() for the running timer
+		detail::timer_wheel               _wheel;
+		detail::timer_wheel::expired_list _posted;     // entries that expire as soon as the service thread gets to them
+		clock::time_point                 _start;
+		clock::duration                   _resolution;
+		uint64_t                          _wakeup_tick{detail::timer_wheel::Never};
+		const entry*                      _running{nullptr};
+		thread::id                        _thread_id;
+		thread                            _thread;
+
+	public:
+		/// @param resolution Duration of a tick. Timers are rounded up to whole ticks
+		explicit timer_service(clock::duration resolution = std::chrono::milliseconds(1)) :
+			_start(clock::now()), _resolution(resolution)
+		{
+			RETHREAD_CHECK(resolution > clock::duration::zero(), std::invalid_argument("Timer resolution should be positive"));
+			std::unique_lock<std::mutex> l(_mutex);
+			_thread = thread(&timer_service::thread_func, this);
+			_thread_id = _thread.get_id();
+		}
+
+		timer_service(const timer_service&) = delete;
+		timer_service& operator = (const timer_service&) = delete;
+
+		/// @note All timers should be disarmed by this moment
+		~timer_service()
+		{ _thread.reset(); }
+
+		/// @brief Shared instance that is created on first use. It's never destroyed, so that tokens in static objects stay valid
+		static timer_service& get_default()
+		{
+			static timer_service* instance = new timer_service();
+			return *instance;
+		}
+
+		clock::duration get_resolution() const
+		{ return _resolution; }
+
+		void arm(entry& e, clock::time_point deadline)
+		{
+			uint64_t tick = to_tick(deadline);
+			std::unique_lock<std::mutex> l(_mutex);
+			_wheel.add(e, tick);
+			if (tick < _wakeup_tick)
+			{
+				_wakeup_tick = tick;
+				_cv.notify_one();
+			}
+		}
+
+		/// @brief Expires the entry in the service thread as soon as possible, without waiting for the next tick.
+		///        Handy for deferring work out of the current call stack. disarm() works for posted entries as well
+		void post(entry& e)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_wheel.add_expired(e, _posted);
+			_cv.notify_one();
+		}
+
+		/// @brief After it returns, expire() of this entry is neither running, nor will be invoked
+		void disarm(entry& e)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_wheel.remove(e);
+			if (RETHREAD_LIKELY(_running != &e) || rethread::this_thread::get_id() == _thread_id) // timer may disarm itself
+				return;
+			_expired_cv.wait(l, [&] { return _running != &e; });
+		}
+
+	private:
+		uint64_t to_tick(clock::time_point deadline) const
+		{
+			if (deadline <= _start)
+				return 0;
+			// Rounding up, so that the timer never expires before the deadline
+			return static_cast<uint64_t>((deadline - _start + _resolution - clock::duration(1)) / _resolution);
+		}
+
+		clock::time_point to_time_point(uint64_t tick) const
+		{ return _start + _resolution * static_cast<clock::rep>(tick); }
+
+		void expire_all(detail::timer_wheel::expired_list& expired, std::unique_lock<std::mutex>& l)
+		{
+			while (entry* e = _wheel.take_expired(expired)) // disarm() may remove entries from the list while the lock is released
+			{
+				_running = e;
+				l.unlock();
+				e->expire();
+				l.lock();
+				_running = nullptr;
+				_expired_cv.notify_all();
+			}
+		}
+
+		void thread_func(const cancellation_token& token)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			while (token)
+			{
+				detail::timer_wheel::expired_list expired;
+				_wheel.advance(static_cast<uint64_t>((clock::now() - _start) / _resolution), expired);
+				expire_all(expired, l);
+				expire_all(_posted, l); // also takes the entries that are posted by the expired ones
+
+				_wakeup_tick = _wheel.next_tick();
+				if (_wakeup_tick == detail::timer_wheel::Never)
+					rethread::wait(_cv, l, token);
+				else
+					rethread::wait_until(_cv, l, to_time_point(_wakeup_tick), token);
+			}
+		}
+	};
+
+
+	/// @brief Token that is cancelled either when the deadline passes, or when the optional parent token is cancelled.
+	///        So a single token passed to blocking calls serves both for shutdown and for timeouts, without any clock reads in the waits.
+	///        Deadline is armed once, in constructor, on a shared timer_service
+	/// @note  Just like standalone_cancellation_token, it can't be copied or moved
+	class deadline_cancellation_token : public standalone_cancellation_token
+	{
+		class timer : public detail::timer_wheel_entry
+		{
+			standalone_cancellation_token& _token;
+
+		public:
+			explicit timer(standalone_cancellation_token& token) : _token(token)
+			{ }
+
+			void expire() override
+			{ _token.cancel(); }
+		};
+
+		timer_service&            _service;
+		timer                     _timer;
+		detail::cancellation_link _parent;
+
+	public:
+		using clock = timer_service::clock;
+
+		explicit deadline_cancellation_token(clock::time_point deadline, timer_service& service = timer_service::get_default()) :
+			_service(service), _timer(*this)
+		{ _service.arm(_timer, deadline); }
+
+		template <typename Rep_, typename Period_>
+		explicit deadline_cancellation_token(const std::chrono::duration<Rep_, Period_>& timeout, timer_service& service = timer_service::get_default()) :
+			deadline_cancellation_token(clock::now() + timeout, service)
+		{ }
+
+		deadline_cancellation_token(const cancellation_token& parent, clock::time_point deadline, timer_service& service = timer_service::get_default()) :
+			_service(service), _timer(*this)
+		{
+			_parent.attach(*this, parent);
+			if (!is_cancelled())
+				_service.arm(_timer, deadline);
+		}
+
+		template <typename Rep_, typename Period_>
+		deadline_cancellation_token(const cancellation_token& parent, const std::chrono::duration<Rep_, Period_>& timeout, timer_service& service = timer_service::get_default()) :
+			deadline_cancellation_token(parent, clock::now() + timeout, service)
+		{ }
+
+		~deadline_cancellation_token()
+		{ _service.disarm(_timer); }
+	};
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef RETHREAD_DETAIL_ALIGNED_ALLOCATION_HPP
+#define RETHREAD_DETAIL_ALIGNED_ALLOCATION_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/detail/config.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Before C++17, new and std::allocator ignore extended alignment, so the classes that hold cache line aligned tokens
+// declare their own operator new. With aligned new (C++17 or -faligned-new) it's not needed
+#if defined(RETHREAD_CACHE_LINE_ALIGNED_TOKENS) && !defined(__cpp_aligned_new)
+#define RETHREAD_TOKEN_ALIGNED_NEW \
+	static void* operator new(std::size_t size) { return ::rethread::detail::aligned_allocate(size, RETHREAD_CACHE_LINE_SIZE); } \
+	static void* operator new[](std::size_t size) { return ::rethread::detail::aligned_allocate(size, RETHREAD_CACHE_LINE_SIZE); } \
+	static void operator delete(void* p) RETHREAD_NOEXCEPT { ::rethread::detail::aligned_deallocate(p); } \
+	static void operator delete[](void* p) RETHREAD_NOEXCEPT { ::rethread::detail::aligned_deallocate(p); }
+#else
+#define RETHREAD_TOKEN_ALIGNED_NEW
+#endif
+
+namespace rethread {
+namespace detail
+{
+
+	/// @brief Over-allocates and keeps the original pointer right before the aligned block, so it doesn't depend on the platform
+	inline void* aligned_allocate(std::size_t size, std::size_t alignment)
+	{
+		void* raw = ::operator new(size + alignment + sizeof(void*));
+		std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*) + alignment - 1) & ~std::uintptr_t(alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	inline void aligned_deallocate(void* p) RETHREAD_NOEXCEPT
+	{
+		if (p)
+			::operator delete(static_cast<void**>(p)[-1]);
+	}
+
+
+	/// @brief Allocator that respects extended alignment of T even before C++17. Falls back to plain new for ordinary types
+	template <typename T>
+	struct aligned_allocator
+	{
+		using value_type = T;
+
+		template <typename U>
+		struct rebind
+		{ using other = aligned_allocator<U>; };
+
+		aligned_allocator() RETHREAD_NOEXCEPT = default;
+
+		template <typename U>
+		aligned_allocator(const aligned_allocator<U>&) RETHREAD_NOEXCEPT
+		{ }
+
+		T* allocate(std::size_t n)
+		{
+			if (!is_over_aligned())
+				return static_cast<T*>(::operator new(n * sizeof(T)));
+			return static_cast<T*>(aligned_allocate(n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T* p, std::size_t) RETHREAD_NOEXCEPT
+		{
+			if (!is_over_aligned())
+				::operator delete(p);
+			else
+				aligned_deallocate(p);
+		}
+
+		template <typename U>
+		bool operator == (const aligned_allocator<U>&) const RETHREAD_NOEXCEPT
+		{ return true; }
+
+		template <typename U>
+		bool operator != (const aligned_allocator<U>&) const RETHREAD_NOEXCEPT
+		{ return false; }
+
+	private:
+		static RETHREAD_CONSTEXPR bool is_over_aligned()
+		{ return alignof(T) > alignof(std::max_align_t); }
+	};
+
+}}
+
+#endif
@@ -53,4 +53,54 @@
 #define RETHREAD_ALIGNOF alignof
 #endif
 
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define RETHREAD_ALIGNAS(Alignment_) __declspec(align(Alignment_))
+#else
+#define RETHREAD_ALIGNAS(Alignment_) alignas(Alignment_)
+#endif
+
+#ifndef RETHREAD_CACHE_LINE_SIZE
+#define RETHREAD_CACHE_LINE_SIZE 64
+#endif
+
+// If RETHREAD_CACHE_LINE_ALIGNED_TOKENS is defined, the state that is read by every token check gets a cache line of its own,
+// so that writes of other threads to the neighbouring data (e.g. links of the sourced tokens) don't evict it. Costs a line per token.
+// Before C++17 (or -faligned-new) make_shared and standard containers don't align tokens, only plain new of a token does
+#ifdef RETHREAD_CACHE_LINE_ALIGNED_TOKENS
+#define RETHREAD_TOKEN_ALIGNAS RETHREAD_ALIGNAS(RETHREAD_CACHE_LINE_SIZE)
+#else
+#define RETHREAD_TOKEN_ALIGNAS
+#endif
+
+#ifndef RETHREAD_SOURCE_SHARDS_COUNT
+#define RETHREAD_SOURCE_SHARDS_COUNT 8
+#endif
+
+// Least number of handlers that cancellation_fan_out::parallel hands to each extra thread. Spawning a thread costs
+// tens of microseconds, so smaller sources are cancelled by fewer threads, or inline
+#ifndef RETHREAD_PARALLEL_CANCEL_HANDLERS_PER_THREAD
+#define RETHREAD_PARALLEL_CANCEL_HANDLERS_PER_THREAD 1024
+#endif
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define RETHREAD_HAS_EXCEPTIONS
+#endif
+
+// Coroutine awaitables are available when the compiler supports C++20 coroutines
+#if !defined(RETHREAD_DISABLE_COROUTINES) && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define RETHREAD_HAS_COROUTINES
+#endif
+#endif
+
+// Upper bound of spinning while waiting for a racing cancel() to finish. Zero disables spinning
+#ifndef RETHREAD_MAX_UNREGISTER_SPINS
+#define RETHREAD_MAX_UNREGISTER_SPINS 1024
+#endif
+
+// Signal that rethread/signal.hpp sends to interrupt blocked calls. A no-op handler is installed on first use, unless the signal has another one
+#ifndef RETHREAD_INTERRUPT_SIGNAL
+#define RETHREAD_INTERRUPT_SIGNAL (SIGRTMIN + 3)
+#endif
+
 #endif
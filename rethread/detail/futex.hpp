@@ -0,0 +1,154 @@
+#ifndef RETHREAD_DETAIL_FUTEX_HPP
+#define RETHREAD_DETAIL_FUTEX_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if !defined(RETHREAD_DISABLE_FUTEX) && defined(__linux__)
+#define RETHREAD_HAS_LINUX_FUTEX
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif !defined(RETHREAD_DISABLE_FUTEX) && defined(_WIN32) && defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0602
+#define RETHREAD_HAS_WAIT_ON_ADDRESS
+#include <windows.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "Synchronization.lib")
+#endif
+#else
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#endif
+
+namespace rethread {
+namespace detail
+{
+
+	/// @brief 32-bit word that threads can wait on without a mutex.
+	///        Backed by futex on Linux and WaitOnAddress on Windows 8+, otherwise emulated by a table of mutexes and condition variables.
+	using futex_word = std::atomic<uint32_t>;
+
+	static_assert(sizeof(futex_word) == sizeof(uint32_t), "std::atomic<uint32_t> is expected to have the same layout as uint32_t");
+
+
+#if defined(RETHREAD_HAS_LINUX_FUTEX)
+
+	inline long futex_call(const futex_word& word, int op, uint32_t val, const timespec* timeout)
+	{ return ::syscall(SYS_futex, reinterpret_cast<const uint32_t*>(&word), op, val, timeout, nullptr, 0); }
+
+	/// @brief Blocks while word equals expected. May return spuriously
+	inline void futex_wait(const futex_word& word, uint32_t expected)
+	{ futex_call(word, FUTEX_WAIT_PRIVATE, expected, nullptr); }
+
+	/// @brief Blocks while word equals expected, but no longer than timeout. May return spuriously
+	inline void futex_wait_for(const futex_word& word, uint32_t expected, std::chrono::nanoseconds timeout)
+	{
+		if (timeout <= std::chrono::nanoseconds::zero())
+			return;
+
+		std::chrono::seconds sec = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+		timespec ts = { };
+		ts.tv_sec = sec.count() < INT_MAX ? static_cast<time_t>(sec.count()) : INT_MAX;
+		ts.tv_nsec = static_cast<long>((timeout - sec).count());
+		futex_call(word, FUTEX_WAIT_PRIVATE, expected, &ts);
+	}
+
+	inline void futex_wake_one(const futex_word& word)
+	{ futex_call(word, FUTEX_WAKE_PRIVATE, 1, nullptr); }
+
+	inline void futex_wake_all(const futex_word& word)
+	{ futex_call(word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr); }
+
+#elif defined(RETHREAD_HAS_WAIT_ON_ADDRESS)
+
+	inline void futex_wait(const futex_word& word, uint32_t expected)
+	{ ::WaitOnAddress(const_cast<futex_word*>(&word), &expected, sizeof(expected), INFINITE); }
+
+	inline void futex_wait_for(const futex_word& word, uint32_t expected, std::chrono::nanoseconds timeout)
+	{
+		if (timeout <= std::chrono::nanoseconds::zero())
+			return;
+
+		// Rounding up, otherwise sub-millisecond timeouts would turn into busy-waiting
+		std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(timeout + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1));
+		DWORD dw = ms.count() < INFINITE ? static_cast<DWORD>(ms.count()) : INFINITE - 1;
+		::WaitOnAddress(const_cast<futex_word*>(&word), &expected, sizeof(expected), dw);
+	}
+
+	inline void futex_wake_one(const futex_word& word)
+	{ ::WakeByAddressSingle(const_cast<futex_word*>(&word)); }
+
+	inline void futex_wake_all(const futex_word& word)
+	{ ::WakeByAddressAll(const_cast<futex_word*>(&word)); }
+
+#else
+
+	/// @brief Waiters are distributed among buckets by address. The waker changes the word before locking the bucket,
+	///        and the waiter checks the word under the bucket lock, so wakeups can't be lost
+	template <typename Dummy_ = void>
+	struct parking_lot
+	{
+		struct bucket
+		{
+			std::mutex              _mutex;
+			std::condition_variable _cv;
+		};
+
+		static RETHREAD_CONSTEXPR size_t BucketsCount = 64;
+		static bucket                    s_buckets[BucketsCount];
+
+		static bucket& get_bucket(const void* address)
+		{ return s_buckets[(reinterpret_cast<std::uintptr_t>(address) >> 4) % BucketsCount]; }
+	};
+
+	template <typename Dummy_>
+	typename parking_lot<Dummy_>::bucket parking_lot<Dummy_>::s_buckets[parking_lot<Dummy_>::BucketsCount];
+
+
+	inline void futex_wait(const futex_word& word, uint32_t expected)
+	{
+		parking_lot<>::bucket& b = parking_lot<>::get_bucket(&word);
+		std::unique_lock<std::mutex> l(b._mutex);
+		if (word.load() == expected)
+			b._cv.wait(l);
+	}
+
+	inline void futex_wait_for(const futex_word& word, uint32_t expected, std::chrono::nanoseconds timeout)
+	{
+		parking_lot<>::bucket& b = parking_lot<>::get_bucket(&word);
+		std::unique_lock<std::mutex> l(b._mutex);
+		if (word.load() == expected)
+			b._cv.wait_for(l, timeout);
+	}
+
+	inline void futex_wake_all(const futex_word& word)
+	{
+		parking_lot<>::bucket& b = parking_lot<>::get_bucket(&word);
+		std::unique_lock<std::mutex> l(b._mutex);
+		b._cv.notify_all();
+	}
+
+	// Bucket is shared between different words, so waking a single thread could wake the wrong one
+	inline void futex_wake_one(const futex_word& word)
+	{ futex_wake_all(word); }
+
+#endif
+
+}}
+
+#endif
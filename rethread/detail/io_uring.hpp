@@ -0,0 +1,380 @@
+#ifndef RETHREAD_DETAIL_IO_URING_HPP
+#define RETHREAD_DETAIL_IO_URING_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <system_error>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace rethread {
+namespace detail
+{
+
+	/// @brief Minimal io_uring wrapper. Completion queue is consumed only by the owning thread,
+	///        but entries can be submitted from any thread, which allows cancellation handlers to submit IORING_OP_ASYNC_CANCEL.
+	class io_uring_ring
+	{
+		static RETHREAD_CONSTEXPR unsigned Entries = 8;
+		static RETHREAD_CONSTEXPR uint64_t CancelUserData = ~uint64_t(0);
+		static RETHREAD_CONSTEXPR uint32_t MaxTransfer = 0x7FFFFFFF; // result is reported as int32 (the kernel caps it lower anyway)
+		static RETHREAD_CONSTEXPR unsigned ProbeOpsCount = 256;
+
+		int           _fd;
+		void*         _sq_ring;
+		size_t        _sq_ring_size;
+		void*         _cq_ring;
+		size_t        _cq_ring_size;
+		io_uring_sqe* _sqes;
+		size_t        _sqes_size;
+
+		unsigned*     _sq_head;
+		unsigned*     _sq_tail;
+		unsigned      _sq_mask;
+		unsigned      _sq_entries;
+		unsigned*     _cq_head;
+		unsigned*     _cq_tail;
+		unsigned      _cq_mask;
+		io_uring_cqe* _cqes;
+
+		std::mutex    _sq_mutex;
+		uint64_t      _next_user_data{0};
+
+	public:
+		/// @brief Handler for a single in-flight operation. Can be reused for consecutive operations on the same ring.
+		class operation : public cancellation_handler
+		{
+			friend class io_uring_ring;
+
+			io_uring_ring& _ring;
+			uint64_t       _user_data{0};
+			bool           _submitted{false};        // guarded by _ring._sq_mutex
+			bool           _cancel_requested{false}; // guarded by _ring._sq_mutex
+
+		public:
+			explicit operation(io_uring_ring& ring) : _ring(ring)
+			{ }
+
+			operation(const operation&) = delete;
+			operation& operator = (const operation&) = delete;
+
+			void cancel() override
+			{ _ring.request_cancel(*this); }
+		};
+
+	public:
+		io_uring_ring(const io_uring_ring&) = delete;
+		io_uring_ring& operator = (const io_uring_ring&) = delete;
+
+		~io_uring_ring()
+		{
+			if (_cq_ring != _sq_ring)
+				::munmap(_cq_ring, _cq_ring_size);
+			::munmap(_sq_ring, _sq_ring_size);
+			::munmap(_sqes, _sqes_size);
+			::close(_fd);
+		}
+
+		/// @returns Ring of the calling thread, or nullptr if io_uring is not available
+		static io_uring_ring* get_thread_ring()
+		{
+			static thread_local std::unique_ptr<io_uring_ring> ring(create());
+			return ring.get();
+		}
+
+		/// @brief   Submits operation and waits for it's completion
+		/// @returns Result of the operation (negated errno on failure). -ECANCELED if the operation was cancelled
+		int submit_and_wait(operation& op, io_uring_sqe sqe)
+		{
+			{
+				std::unique_lock<std::mutex> l(_sq_mutex);
+				if (op._cancel_requested)
+					return -ECANCELED;
+
+				op._user_data = sqe.user_data = _next_user_data++;
+				op._submitted = true;
+				push(sqe);
+			}
+
+			check_enter(enter(1, 1, IORING_ENTER_GETEVENTS));
+			for (;;)
+			{
+				int result;
+				if (reap(op._user_data, result))
+					return result;
+				check_enter(enter(0, 1, IORING_ENTER_GETEVENTS));
+			}
+		}
+
+		/// @note Transfers that don't fit the 32-bit length are clamped, so they complete partially, and the transfer loops go on
+		static io_uring_sqe make_rw(uint8_t opcode, int fd, const void* buf, size_t nbyte)
+		{
+			io_uring_sqe sqe;
+			std::memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = opcode;
+			sqe.fd = fd;
+			sqe.off = ~uint64_t(0); // use current file position
+			sqe.addr = reinterpret_cast<uint64_t>(buf);
+			sqe.len = static_cast<uint32_t>(std::min<size_t>(nbyte, MaxTransfer));
+			return sqe;
+		}
+
+		static io_uring_sqe make_msg(uint8_t opcode, int fd, const void* buf, size_t nbyte, int flags)
+		{
+			io_uring_sqe sqe = make_rw(opcode, fd, buf, nbyte);
+			sqe.off = 0;
+			sqe.msg_flags = static_cast<uint32_t>(flags);
+			return sqe;
+		}
+
+		static io_uring_sqe make_poll(int fd, short events)
+		{
+			io_uring_sqe sqe;
+			std::memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = IORING_OP_POLL_ADD;
+			sqe.fd = fd;
+			sqe.poll_events = static_cast<uint16_t>(events); // the kernel reads the same bits through poll32_events, if it has them
+			return sqe;
+		}
+
+		static io_uring_sqe make_accept(int fd, sockaddr* addr, socklen_t* addrlen, int flags)
+		{
+			io_uring_sqe sqe;
+			std::memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = IORING_OP_ACCEPT;
+			sqe.fd = fd;
+			sqe.addr = reinterpret_cast<uint64_t>(addr);
+			sqe.addr2 = reinterpret_cast<uint64_t>(addrlen);
+			sqe.accept_flags = static_cast<uint32_t>(flags);
+			return sqe;
+		}
+
+	private:
+		io_uring_ring() :
+			_fd(-1), _sq_ring(MAP_FAILED), _sq_ring_size(0), _cq_ring(MAP_FAILED), _cq_ring_size(0), _sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), _sqes_size(0)
+		{ }
+
+		static io_uring_ring* create()
+		{
+			std::unique_ptr<io_uring_ring> ring(new io_uring_ring());
+			io_uring_params params;
+			std::memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CLAMP;
+
+			ring->_fd = static_cast<int>(::syscall(__NR_io_uring_setup, Entries, &params));
+			if (ring->_fd < 0 || !supports_required_ops(ring->_fd))
+				return nullptr;
+
+			ring->_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			ring->_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+				ring->_sq_ring_size = ring->_cq_ring_size = std::max(ring->_sq_ring_size, ring->_cq_ring_size);
+
+			ring->_sq_ring = ::mmap(nullptr, ring->_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->_fd, IORING_OFF_SQ_RING);
+			if (ring->_sq_ring == MAP_FAILED)
+				return nullptr;
+
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+				ring->_cq_ring = ring->_sq_ring;
+			else
+			{
+				ring->_cq_ring = ::mmap(nullptr, ring->_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->_fd, IORING_OFF_CQ_RING);
+				if (ring->_cq_ring == MAP_FAILED)
+					return nullptr;
+			}
+
+			ring->_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+			void* sqes = ::mmap(nullptr, ring->_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->_fd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED)
+				return nullptr;
+			ring->_sqes = static_cast<io_uring_sqe*>(sqes);
+
+			char* sq = static_cast<char*>(ring->_sq_ring);
+			ring->_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+			ring->_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			ring->_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			ring->_sq_entries = params.sq_entries;
+
+			// Submission queue entries are always used in order, so the indirection array is set up only once
+			unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			for (unsigned i = 0; i < params.sq_entries; ++i)
+				sq_array[i] = i;
+
+			char* cq = static_cast<char*>(ring->_cq_ring);
+			ring->_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			ring->_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			ring->_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+			ring->_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+			return ring.release();
+		}
+
+		/// @brief Older kernels have io_uring, but not all of the opcodes, and would fail every operation with -EINVAL
+		static bool supports_required_ops(int fd)
+		{
+			static const uint8_t required[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_SEND, IORING_OP_RECV, IORING_OP_ACCEPT, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+
+			union
+			{
+				io_uring_probe probe;
+				unsigned char  buffer[sizeof(io_uring_probe) + ProbeOpsCount * sizeof(io_uring_probe_op)];
+			} storage;
+			std::memset(&storage, 0, sizeof(storage));
+			if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &storage.probe, ProbeOpsCount) < 0)
+				return false; // probing appeared in 5.6, together with IORING_OP_READ and IORING_OP_WRITE
+
+			for (uint8_t op : required)
+				if (op > storage.probe.last_op || op >= storage.probe.ops_len || !(storage.probe.ops[op].flags & IO_URING_OP_SUPPORTED))
+					return false;
+			return true;
+		}
+
+		int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+		{ return static_cast<int>(::syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete, flags, nullptr, 0)); }
+
+		/// @brief Interrupted or busy io_uring_enter is simply retried by the caller
+		static void check_enter(int res)
+		{ RETHREAD_CHECK(res >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY, std::system_error(errno, std::system_category(), "io_uring_enter failed")); }
+
+		/// @pre _sq_mutex is locked
+		void push(const io_uring_sqe& sqe)
+		{
+			unsigned tail = *_sq_tail;
+			while (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) == _sq_entries)
+			{
+				// Queue is full of entries pushed by other threads that didn't reach io_uring_enter yet
+				check_enter(enter(_sq_entries, 0, 0));
+			}
+
+			_sqes[tail & _sq_mask] = sqe;
+			__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		/// @brief Consumes available completions. Completions of other operations are stale results of cancellation requests
+		bool reap(uint64_t userData, int& result)
+		{
+			bool found = false;
+			unsigned head = *_cq_head;
+			unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail && !found; ++head)
+			{
+				const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+				if (cqe.user_data == userData)
+				{
+					result = cqe.res;
+					found = true;
+				}
+			}
+			__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+			return found;
+		}
+
+		void request_cancel(operation& op)
+		{
+			{
+				std::unique_lock<std::mutex> l(_sq_mutex);
+				op._cancel_requested = true;
+				if (!op._submitted)
+					return;
+
+				io_uring_sqe sqe;
+				std::memset(&sqe, 0, sizeof(sqe));
+				sqe.opcode = IORING_OP_ASYNC_CANCEL;
+				sqe.fd = -1;
+				sqe.addr = op._user_data;
+				sqe.user_data = CancelUserData;
+				push(sqe);
+			}
+
+			check_enter(enter(1, 0, 0));
+		}
+	};
+
+
+	/// @brief   Performs operation on the io_uring of the calling thread
+	/// @returns Result of the operation (negated errno on failure), -ECANCELED if cancelled
+	inline int io_uring_call(io_uring_ring& ring, const io_uring_sqe& sqe, const cancellation_token& token)
+	{
+		io_uring_ring::operation op(ring);
+		cancellation_guard guard(token, op);
+		if (guard.is_cancelled())
+			return -ECANCELED;
+		return ring.submit_and_wait(op, sqe);
+	}
+
+
+	/// @brief   Submits make_sqe(done) until nbyte bytes are transferred, using the same registered handler for all operations
+	/// @details Non-blocking descriptors fail the transfer with -EAGAIN instead of waiting, so the loop waits for the events
+	///          with IORING_OP_POLL_ADD before the next attempt, and that wait is cancelled like the transfer itself
+	/// @returns Number of bytes transferred before cancellation or error, -1 if error occurred before transferring anything
+	template <typename MakeSqe>
+	ssize_t io_uring_transfer_all(io_uring_ring& ring, int fd, short events, size_t nbyte, const cancellation_token& token, MakeSqe make_sqe)
+	{
+		io_uring_ring::operation op(ring);
+		cancellation_guard guard(token, op);
+		if (guard.is_cancelled())
+			return 0;
+
+		size_t done = 0;
+		while (done < nbyte)
+		{
+			int res = ring.submit_and_wait(op, make_sqe(done));
+			if (res == -EAGAIN)
+			{
+				res = ring.submit_and_wait(op, io_uring_ring::make_poll(fd, events));
+				if (res > 0)
+					continue;
+			}
+			if (res > 0)
+				done += static_cast<size_t>(res);
+			else if (res == 0 || res == -ECANCELED)
+				break;
+			else if (res != -EINTR)
+			{
+				if (done)
+					break;
+				errno = -res;
+				return -1;
+			}
+		}
+		return static_cast<ssize_t>(done);
+	}
+
+
+	/// @brief   Converts io_uring result to the POSIX convention
+	/// @returns cancelledValue if the operation was cancelled
+	inline ssize_t io_uring_result(int res, ssize_t cancelledValue)
+	{
+		if (res == -ECANCELED)
+			return cancelledValue;
+		if (res < 0)
+		{
+			errno = -res;
+			return -1;
+		}
+		return res;
+	}
+
+}}
+
+#endif
@@ -17,9 +17,16 @@ namespace detail
 {
 
 	template <typename Derived_, typename Category_, typename T_, typename Distance_ = std::ptrdiff_t, typename Pointer_ = T_*, typename Reference_ = T_&>
-	class iterator_base : public std::iterator<Category_, T_, Distance_, Pointer_, Reference_>
+	class iterator_base
 	{
 	public:
+		// std::iterator is deprecated since C++17, so the traits are declared directly
+		using iterator_category = Category_;
+		using value_type        = T_;
+		using difference_type   = Distance_;
+		using pointer           = Pointer_;
+		using reference         = Reference_;
+
 		bool operator ==(Derived_ other) const
 		{ return get_derived().equal(other); }
 
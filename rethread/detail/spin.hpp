@@ -0,0 +1,81 @@
+#ifndef RETHREAD_DETAIL_SPIN_HPP
+#define RETHREAD_DETAIL_SPIN_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/detail/config.hpp>
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+
+namespace rethread {
+namespace detail
+{
+
+	inline void cpu_relax()
+	{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		_mm_pause();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+		__builtin_ia32_pause();
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__arm__))
+		__asm__ __volatile__("yield");
+#endif
+	}
+
+
+	/// @brief Spin budget follows the observed time it takes a handler to finish, similarly to adaptive mutexes
+	template <typename Dummy_ = void>
+	struct adaptive_spin
+	{
+		static RETHREAD_CONSTEXPR uint32_t MinSpins = 16;
+		static RETHREAD_CONSTEXPR uint32_t MaxSpins = RETHREAD_MAX_UNREGISTER_SPINS;
+
+		static std::atomic<uint32_t> s_limit;
+
+		/// @param spins Receives the number of spins performed
+		/// @returns Whether predicate became true while spinning
+		template <typename Predicate_>
+		static bool spin_until(Predicate_ predicate, uint32_t& spins)
+		{
+			uint32_t limit = s_limit.load(std::memory_order_relaxed);
+			for (spins = 0; spins < limit; ++spins)
+			{
+				if (predicate())
+				{
+					update(limit, spins * 2 + MinSpins);
+					return true;
+				}
+				cpu_relax();
+			}
+			update(limit, MinSpins);
+			return predicate();
+		}
+
+	private:
+		static void update(uint32_t limit, uint32_t target)
+		{
+			target = target < MaxSpins ? target : MaxSpins;
+			int32_t delta = (static_cast<int32_t>(target) - static_cast<int32_t>(limit)) / 8;
+			if (delta != 0)
+				s_limit.store(static_cast<uint32_t>(static_cast<int32_t>(limit) + delta), std::memory_order_relaxed); // lost updates are harmless
+		}
+	};
+
+	template <typename Dummy_>
+	std::atomic<uint32_t> adaptive_spin<Dummy_>::s_limit{adaptive_spin<Dummy_>::MaxSpins < 64 ? adaptive_spin<Dummy_>::MaxSpins : 64};
+
+}}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef RETHREAD_DETAIL_TIMER_WHEEL_HPP
+#define RETHREAD_DETAIL_TIMER_WHEEL_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/detail/intrusive_list.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+namespace rethread {
+namespace detail
+{
+
+	class timer_wheel;
+
+
+	class timer_wheel_entry : public intrusive_list_node<false>
+	{
+		friend class timer_wheel;
+
+		uint64_t      _expiry{0};
+		bool          _armed{false};
+		unsigned char _level{0};
+
+	public:
+		/// @brief Invoked by the owner of the wheel after the entry was taken out of it
+		virtual void expire() = 0;
+
+		bool is_armed() const
+		{ return _armed; }
+
+	protected:
+		timer_wheel_entry() = default;
+		~timer_wheel_entry() = default;
+	};
+
+
+	/// @brief Hierarchical timer wheel (Varghese & Lauck). Deadlines are measured in abstract ticks.
+	///        Level L holds entries that expire within 64^(L + 1) ticks, slot is picked by the corresponding bits of the expiry,
+	///        and the entries of a slot are moved one level down when the lower level wraps around.
+	///        Inserting and removing an entry is O(1), the wheel is not thread-safe.
+	class timer_wheel
+	{
+		using entry_list = intrusive_list<timer_wheel_entry>;
+
+		static RETHREAD_CONSTEXPR unsigned SlotBits = 6;
+		static RETHREAD_CONSTEXPR unsigned SlotsCount = 1u << SlotBits;
+		static RETHREAD_CONSTEXPR unsigned LevelsCount = 4;
+		static RETHREAD_CONSTEXPR unsigned char ExpiredLevel = 0xFF;
+
+		entry_list _slots[LevelsCount][SlotsCount];
+		entry_list _overflow; // entries that are further than 64^4 ticks away
+		size_t     _level0_count{0};
+		size_t     _count{0};
+		uint64_t   _now{0};
+
+	public:
+		using expired_list = entry_list;
+
+		static RETHREAD_CONSTEXPR uint64_t Never = std::numeric_limits<uint64_t>::max();
+
+		timer_wheel() = default;
+		timer_wheel(const timer_wheel&) = delete;
+		timer_wheel& operator = (const timer_wheel&) = delete;
+
+		~timer_wheel()
+		{ RETHREAD_ASSERT(_count == 0, "Timer wheel still has entries!"); }
+
+		uint64_t now() const
+		{ return _now; }
+
+		bool empty() const
+		{ return _count == 0; }
+
+		/// @brief Entries that are already due expire on the next tick
+		void add(timer_wheel_entry& entry, uint64_t expiry)
+		{
+			RETHREAD_CHECK(!entry._armed, std::logic_error("Timer is already armed"));
+			entry._expiry = expiry > _now ? expiry : _now + 1;
+			entry._armed = true;
+			place(entry);
+			++_count;
+		}
+
+		/// @brief Arms the entry as already expired, bypassing the slots, so that the owner takes it with take_expired(list)
+		void add_expired(timer_wheel_entry& entry, expired_list& list)
+		{
+			RETHREAD_CHECK(!entry._armed, std::logic_error("Timer is already armed"));
+			entry._expiry = _now;
+			entry._armed = true;
+			entry._level = ExpiredLevel;
+			list.push_back(entry);
+			++_count;
+		}
+
+		/// @brief Also works for entries that were moved to an expired_list, but not expired yet
+		void remove(timer_wheel_entry& entry)
+		{
+			if (!entry._armed)
+				return;
+
+			if (entry._level == 0)
+				--_level0_count;
+			entry_list().erase(entry);
+			entry._armed = false;
+			--_count;
+		}
+
+		/// @brief Moves everything that expires not later than tick to expired. Entries stay armed until remove() or take_expired()
+		void advance(uint64_t tick, expired_list& expired)
+		{
+			while (_now < tick)
+			{
+				if (_count == 0)
+				{
+					_now = tick;
+					break;
+				}
+
+				if (_level0_count == 0)
+				{
+					// Nothing can expire before the next wrap-around, when the upper levels need cascading
+					uint64_t next = (_now | (SlotsCount - 1)) + 1;
+					if (next > tick)
+					{
+						_now = tick;
+						break;
+					}
+					_now = next - 1;
+				}
+
+				++_now;
+				if ((_now & (SlotsCount - 1)) == 0)
+					cascade();
+
+				entry_list& slot = _slots[0][_now & (SlotsCount - 1)];
+				while (!slot.empty())
+				{
+					timer_wheel_entry& e = *slot.begin();
+					slot.erase(e);
+					--_level0_count;
+					e._level = ExpiredLevel;
+					expired.push_back(e);
+				}
+			}
+		}
+
+		/// @brief Takes an entry from the list that was filled by advance(), and disarms it
+		/// @returns nullptr if the list is empty
+		timer_wheel_entry* take_expired(expired_list& expired)
+		{
+			if (expired.empty())
+				return nullptr;
+
+			timer_wheel_entry& e = *expired.begin();
+			expired.erase(e);
+			e._armed = false;
+			--_count;
+			return &e;
+		}
+
+		/// @brief Lower bound for the tick when advance() has something to do: either an entry expires, or the upper levels need cascading
+		uint64_t next_tick() const
+		{
+			if (_count == 0)
+				return Never;
+
+			uint64_t wrap = (_now | (SlotsCount - 1)) + 1;
+			if (_level0_count != 0)
+				for (uint64_t t = _now + 1; t < wrap; ++t)
+					if (!_slots[0][t & (SlotsCount - 1)].empty())
+						return t;
+			return wrap;
+		}
+
+	private:
+		void place(timer_wheel_entry& entry)
+		{
+			uint64_t delta = entry._expiry - _now;
+			for (unsigned level = 0; level < LevelsCount; ++level)
+				if (delta < (uint64_t(1) << (SlotBits * (level + 1))))
+				{
+					_slots[level][(entry._expiry >> (SlotBits * level)) & (SlotsCount - 1)].push_back(entry);
+					entry._level = static_cast<unsigned char>(level);
+					if (level == 0)
+						++_level0_count;
+					return;
+				}
+			_overflow.push_back(entry);
+			entry._level = LevelsCount;
+		}
+
+		void cascade()
+		{
+			for (unsigned level = 1; level < LevelsCount; ++level)
+			{
+				unsigned slot = (_now >> (SlotBits * level)) & (SlotsCount - 1);
+				relocate(_slots[level][slot]);
+				if (slot != 0)
+					return;
+			}
+			relocate(_overflow);
+		}
+
+		void relocate(entry_list& list)
+		{
+			while (!list.empty())
+			{
+				timer_wheel_entry& e = *list.begin();
+				list.erase(e);
+				place(e);
+			}
+		}
+	};
+
+}}
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef RETHREAD_EPOLL_HPP
+#define RETHREAD_EPOLL_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/coroutine.hpp>
+#include <rethread/poll.hpp>
+#include <rethread/detail/intrusive_list.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <cstdint>
+#include <mutex>
+#include <system_error>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace rethread
+{
+	/// @brief Cancellable epoll set. Descriptor of the cancellation handler is added to the set once, at construction,
+	///        so each wait() costs a handler registration and a single epoll_wait() call.
+	/// @note  wait() shouldn't be invoked concurrently from several threads, since all waits share the same handler.
+	///        Adding, modifying and removing descriptors is thread-safe.
+	class epoll_reactor
+	{
+		int                               _epoll;
+		detail::poll_cancellation_handler _handler;
+
+	public:
+		epoll_reactor()
+		{
+			_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+			RETHREAD_CHECK(_epoll != -1, std::system_error(errno, std::system_category(), "epoll_create1 failed"));
+
+			epoll_event event = { };
+			event.events = EPOLLIN;
+			event.data.ptr = &_handler;
+			if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, _handler.get_fd(), &event) != 0)
+			{
+				int error = errno;
+				::close(_epoll);
+				RETHREAD_THROW(std::system_error(error, std::system_category(), "epoll_ctl failed"));
+			}
+		}
+
+		~epoll_reactor()
+		{ RETHREAD_CHECK(::close(_epoll) == 0, std::system_error(errno, std::system_category())); }
+
+		epoll_reactor(const epoll_reactor&) = delete;
+		epoll_reactor& operator = (const epoll_reactor&) = delete;
+
+		void add(int fd, uint32_t events, epoll_data_t data)
+		{ control(EPOLL_CTL_ADD, fd, events, data); }
+
+		void add(int fd, uint32_t events)
+		{ add(fd, events, make_data(fd)); }
+
+		void modify(int fd, uint32_t events, epoll_data_t data)
+		{ control(EPOLL_CTL_MOD, fd, events, data); }
+
+		void modify(int fd, uint32_t events)
+		{ modify(fd, events, make_data(fd)); }
+
+		void remove(int fd)
+		{ RETHREAD_CHECK(::epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr) == 0, std::system_error(errno, std::system_category())); }
+
+		/// @brief   Waits for the events on the registered descriptors
+		/// @returns Number of events stored to [events, events + maxEvents). Zero if cancelled or timed out
+		int wait(epoll_event* events, int maxEvents, int timeoutMs, const cancellation_token& token)
+		{
+			cancellation_guard guard(token, _handler);
+			if (guard.is_cancelled())
+				return 0;
+
+			int count = ::epoll_wait(_epoll, events, maxEvents, timeoutMs);
+			RETHREAD_CHECK(count != -1, std::system_error(errno, std::system_category()));
+
+			// Only ready events are scanned, so the cost doesn't depend on the number of registered descriptors
+			for (int i = 0; i < count; ++i)
+				if (events[i].data.ptr == &_handler)
+				{
+					events[i] = events[--count];
+					break;
+				}
+			return count;
+		}
+
+		int wait(epoll_event* events, int maxEvents, const cancellation_token& token)
+		{ return wait(events, maxEvents, -1, token); }
+
+		int native_handle() const
+		{ return _epoll; }
+
+	private:
+		void control(int op, int fd, uint32_t events, epoll_data_t data)
+		{
+			epoll_event event = { };
+			event.events = events;
+			event.data = data;
+			RETHREAD_CHECK(::epoll_ctl(_epoll, op, fd, &event) == 0, std::system_error(errno, std::system_category()));
+		}
+
+		static epoll_data_t make_data(int fd)
+		{
+			epoll_data_t data = { };
+			data.fd = fd;
+			return data;
+		}
+	};
+
+#ifdef RETHREAD_HAS_COROUTINES
+
+	/// @brief Lets coroutines co_await descriptor readiness without blocking threads. A single thread drives the reactor with run(),
+	///        and all waiting coroutines are resumed from that thread, either with the ready events or with zero if cancelled.
+	///        Cancelling thread only posts the wait to the run() thread, since it can't synchronize with the events that are
+	///        being processed there.
+	/// @note  Each descriptor can have only one pending wait. Waits that are pending when run() returns are resumed by the next run().
+	///        Coroutine with a pending wait may be destroyed either in the run() thread, or while run() is not running
+	class coroutine_reactor
+	{
+	public:
+		class awaiter : public detail::intrusive_list_node<false>
+		{
+			friend class coroutine_reactor;
+			friend class detail::coroutine_cancellation_callback<awaiter>;
+
+			coroutine_reactor&                                _reactor;
+			int                                               _fd;
+			uint32_t                                          _events;
+			const cancellation_token&                         _token;
+			bool                                              _posted{false}; // guarded by the reactor mutex
+			bool                                              _registered{false};
+			detail::coroutine_resumer                         _resumer;
+			detail::coroutine_cancellation_callback<awaiter> _callback;
+
+		public:
+			awaiter(coroutine_reactor& reactor, int fd, uint32_t events, const cancellation_token& token) :
+				_reactor(reactor), _fd(fd), _events(events), _token(token)
+			{ }
+
+			~awaiter()
+			{
+				_callback.detach();
+				_reactor.forget(*this);
+			}
+
+			awaiter(const awaiter&) = delete;
+			awaiter& operator = (const awaiter&) = delete;
+
+			bool await_ready() const
+			{ return _token.is_cancelled(); }
+
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				_resumer.set_handle(handle);
+				epoll_data_t data = { };
+				data.ptr = this;
+				_reactor._reactor.add(_fd, _events | EPOLLONESHOT, data);
+				_registered = true;
+				_callback.attach(*this, _token);
+				return _resumer.suspend();
+			}
+
+			/// @returns Ready events, zero if cancelled
+			uint32_t await_resume() const
+			{ return _resumer.get_result(); }
+
+		private:
+			void on_cancelled()
+			{ _reactor.post(*this); }
+		};
+
+	private:
+		epoll_reactor                     _reactor;
+		detail::poll_cancellation_handler _wakeup; // not registered in any token, only wakes run() up
+		std::mutex                        _mutex;
+		detail::intrusive_list<awaiter>   _posted;
+		bool                              _wakeup_pending{false};
+		epoll_event*                      _batch{nullptr}; // events that run() is processing, accessed only by the run() thread
+		int                               _batch_count{0};
+
+	public:
+		coroutine_reactor()
+		{
+			epoll_data_t data = { };
+			data.ptr = &_wakeup;
+			_reactor.add(_wakeup.get_fd(), EPOLLIN, data);
+		}
+
+		coroutine_reactor(const coroutine_reactor&) = delete;
+		coroutine_reactor& operator = (const coroutine_reactor&) = delete;
+
+		/// @brief co_await async_wait(fd, EPOLLIN, token) suspends the coroutine until the descriptor is ready
+		awaiter async_wait(int fd, uint32_t events, const cancellation_token& token)
+		{ return awaiter(*this, fd, events, token); }
+
+		/// @brief Resumes the coroutines until the token is cancelled
+		void run(const cancellation_token& token)
+		{
+			epoll_event events[64];
+			while (token)
+			{
+				int count = _reactor.wait(events, 64, token);
+				bool wakeup = false;
+				_batch = events;
+				_batch_count = count;
+				for (int i = 0; i < count; ++i)
+				{
+					if (events[i].data.ptr == &_wakeup)
+					{
+						wakeup = true; // cancelled waits are resumed after this batch, since their descriptors may be in it too
+						continue;
+					}
+					if (!events[i].data.ptr)
+						continue; // awaiter was destroyed by a coroutine that was resumed earlier in this batch
+					awaiter& a = *static_cast<awaiter*>(events[i].data.ptr);
+					complete(a, events[i].events);
+				}
+				_batch = nullptr;
+				_batch_count = 0;
+				if (wakeup)
+					resume_posted();
+			}
+		}
+
+	private:
+		// Awaiters are completed only in run(), so the awaiter that is not completed yet can't be destroyed by anyone else
+		void complete(awaiter& a, uint32_t events)
+		{
+			_reactor.remove(a._fd);
+			a._resumer.try_complete(events);
+		}
+
+		void post(awaiter& a)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_posted.push_back(a);
+			a._posted = true;
+			if (!_wakeup_pending)
+			{
+				_wakeup_pending = true;
+				_wakeup.cancel();
+			}
+		}
+
+		void forget(awaiter& a)
+		{
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				if (a._posted)
+				{
+					_posted.erase(a);
+					a._posted = false;
+				}
+			}
+
+			if (!a._registered || a._resumer.is_completed())
+				return;
+			// Coroutine is destroyed in the middle of the wait, so epoll shouldn't report the events to the dead awaiter
+			_reactor.remove(a._fd);
+			for (int i = 0; i < _batch_count; ++i)
+				if (_batch[i].data.ptr == &a)
+					_batch[i].data.ptr = nullptr;
+		}
+
+		void resume_posted()
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			if (_wakeup_pending)
+			{
+				_wakeup_pending = false;
+				_wakeup.reset();
+			}
+			while (!_posted.empty())
+			{
+				awaiter& a = *_posted.begin();
+				_posted.erase(a);
+				a._posted = false;
+				if (a._resumer.is_completed())
+					continue; // already resumed with the events, and its coroutine will destroy it
+				l.unlock();
+				complete(a, 0);
+				l.lock();
+			}
+		}
+	};
+
+#endif
+}
+
+#endif
@@ -0,0 +1,361 @@
+#ifndef RETHREAD_FUTURE_HPP
+#define RETHREAD_FUTURE_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/condition_variable.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace rethread
+{
+	namespace detail
+	{
+		template <typename T_>
+		class future_storage
+		{
+			typename std::aligned_storage<sizeof(T_), std::alignment_of<T_>::value>::type _storage;
+			bool                                                                         _constructed{false};
+
+		public:
+			using const_reference = const T_&;
+
+			future_storage() = default;
+			future_storage(const future_storage&) = delete;
+			future_storage& operator = (const future_storage&) = delete;
+
+			~future_storage()
+			{
+				if (_constructed)
+					ptr()->~T_();
+			}
+
+			template <typename U_>
+			void set(U_&& value)
+			{
+				::new(static_cast<void*>(&_storage)) T_(std::forward<U_>(value));
+				_constructed = true;
+			}
+
+			T_&& take()
+			{ return std::move(*ptr()); }
+
+			const T_& get() const
+			{ return *reinterpret_cast<const T_*>(&_storage); }
+
+		private:
+			T_* ptr()
+			{ return reinterpret_cast<T_*>(&_storage); }
+		};
+
+
+		template <typename T_>
+		class future_storage<T_&>
+		{
+			T_* _value{nullptr};
+
+		public:
+			using const_reference = T_&;
+
+			void set(T_& value)
+			{ _value = &value; }
+
+			T_& take()
+			{ return *_value; }
+
+			T_& get() const
+			{ return *_value; }
+		};
+
+
+		template <>
+		class future_storage<void>
+		{
+		public:
+			using const_reference = void;
+
+			void set()
+			{ }
+
+			void take()
+			{ }
+
+			void get() const
+			{ }
+		};
+
+
+		/// @brief Shared state of promise and futures. Readiness is mirrored to an atomic, so waiting for a ready future
+		///        doesn't lock the mutex or register a cancellation handler
+		template <typename T_>
+		class future_state
+		{
+			std::mutex              _mutex;
+			std::condition_variable _cv;
+			std::atomic<bool>       _ready{false};
+			bool                    _retrieved{false};
+			std::exception_ptr      _exception;
+			future_storage<T_>      _value;
+
+		public:
+			template <typename... Args_>
+			void set_value(Args_&&... args)
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				check_not_ready();
+				_value.set(std::forward<Args_>(args)...);
+				make_ready();
+			}
+
+			void set_exception(std::exception_ptr exception)
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				check_not_ready();
+				_exception = exception;
+				make_ready();
+			}
+
+			/// @returns False if the future was already retrieved
+			bool retrieve()
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				bool retrieved = _retrieved;
+				_retrieved = true;
+				return !retrieved;
+			}
+
+			bool is_ready() const
+			{ return _ready.load(std::memory_order_acquire); }
+
+			void wait()
+			{
+				if (is_ready())
+					return;
+				std::unique_lock<std::mutex> l(_mutex);
+				_cv.wait(l, [this] { return _ready.load(std::memory_order_relaxed); });
+			}
+
+			/// @returns False if cancelled
+			bool wait(const cancellation_token& token)
+			{
+				if (is_ready())
+					return true;
+				std::unique_lock<std::mutex> l(_mutex);
+				return rethread::wait(_cv, l, token, [this] { return _ready.load(std::memory_order_relaxed); });
+			}
+
+			/// @pre Should be ready
+			future_storage<T_>& get_value()
+			{
+				if (_exception)
+					std::rethrow_exception(_exception);
+				return _value;
+			}
+
+		private:
+			void check_not_ready() const
+			{ RETHREAD_CHECK(!_ready.load(std::memory_order_relaxed), std::future_error(std::future_errc::promise_already_satisfied)); }
+
+			void make_ready()
+			{
+				_ready.store(true, std::memory_order_release);
+				_cv.notify_all();
+			}
+		};
+	}
+
+
+	template <typename T>
+	class shared_future;
+
+
+	template <typename T>
+	class promise;
+
+
+	/// @brief Counterpart of std::future that can be waited with a cancellation token
+	template <typename T>
+	class future
+	{
+		using state_ptr = std::shared_ptr<detail::future_state<T>>;
+
+		state_ptr _state;
+
+	public:
+		future() RETHREAD_NOEXCEPT = default;
+		future(future&&) RETHREAD_NOEXCEPT = default;
+		future& operator = (future&&) RETHREAD_NOEXCEPT = default;
+		future(const future&) = delete;
+		future& operator = (const future&) = delete;
+
+		bool valid() const
+		{ return static_cast<bool>(_state); }
+
+		bool is_ready() const
+		{ return get_state().is_ready(); }
+
+		void wait() const
+		{ get_state().wait(); }
+
+		/// @returns False if cancelled
+		bool wait(const cancellation_token& token) const
+		{ return get_state().wait(token); }
+
+		/// @brief Blocks until the result is ready and takes it. Rethrows the exception that was stored in the promise
+		/// @post  valid() == false
+		T get()
+		{
+			state_ptr state = std::move(_state);
+			RETHREAD_CHECK(state, std::future_error(std::future_errc::no_state));
+			state->wait();
+			return state->get_value().take();
+		}
+
+		shared_future<T> share()
+		{ return shared_future<T>(std::move(_state)); }
+
+	private:
+		explicit future(state_ptr state) : _state(std::move(state))
+		{ }
+
+		detail::future_state<T>& get_state() const
+		{
+			RETHREAD_CHECK(_state, std::future_error(std::future_errc::no_state));
+			return *_state;
+		}
+
+		friend class promise<T>;
+	};
+
+
+	/// @brief Counterpart of std::shared_future that can be waited with a cancellation token
+	template <typename T>
+	class shared_future
+	{
+		using state_ptr = std::shared_ptr<detail::future_state<T>>;
+
+		state_ptr _state;
+
+	public:
+		shared_future() RETHREAD_NOEXCEPT = default;
+
+		shared_future(future<T>&& other) RETHREAD_NOEXCEPT : shared_future(other.share())
+		{ }
+
+		bool valid() const
+		{ return static_cast<bool>(_state); }
+
+		bool is_ready() const
+		{ return get_state().is_ready(); }
+
+		void wait() const
+		{ get_state().wait(); }
+
+		/// @returns False if cancelled
+		bool wait(const cancellation_token& token) const
+		{ return get_state().wait(token); }
+
+		/// @brief Blocks until the result is ready. Rethrows the exception that was stored in the promise
+		typename detail::future_storage<T>::const_reference get() const
+		{
+			detail::future_state<T>& state = get_state();
+			state.wait();
+			return state.get_value().get();
+		}
+
+	private:
+		explicit shared_future(state_ptr state) : _state(std::move(state))
+		{ }
+
+		detail::future_state<T>& get_state() const
+		{
+			RETHREAD_CHECK(_state, std::future_error(std::future_errc::no_state));
+			return *_state;
+		}
+
+		friend class future<T>;
+	};
+
+
+	/// @brief Counterpart of std::promise. If it's destroyed without setting the result, the future gets std::future_errc::broken_promise
+	template <typename T>
+	class promise
+	{
+		std::shared_ptr<detail::future_state<T>> _state;
+
+	public:
+		promise() : _state(std::make_shared<detail::future_state<T>>())
+		{ }
+
+		promise(promise&&) RETHREAD_NOEXCEPT = default;
+		promise& operator = (promise&& other) RETHREAD_NOEXCEPT
+		{
+			promise(std::move(other)).swap(*this);
+			return *this;
+		}
+
+		promise(const promise&) = delete;
+		promise& operator = (const promise&) = delete;
+
+		~promise()
+		{
+			if (_state && !_state->is_ready())
+				_state->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+		}
+
+		void swap(promise& other) RETHREAD_NOEXCEPT
+		{ _state.swap(other._state); }
+
+		future<T> get_future()
+		{
+			RETHREAD_CHECK(_state, std::future_error(std::future_errc::no_state));
+			RETHREAD_CHECK(_state->retrieve(), std::future_error(std::future_errc::future_already_retrieved));
+			return future<T>(_state);
+		}
+
+		/// @brief Takes the value for promise<T>, a reference for promise<T&>, and nothing for promise<void>
+		template <typename... Args>
+		void set_value(Args&&... args)
+		{
+			RETHREAD_CHECK(_state, std::future_error(std::future_errc::no_state));
+			_state->set_value(std::forward<Args>(args)...);
+		}
+
+		void set_exception(std::exception_ptr exception)
+		{
+			RETHREAD_CHECK(_state, std::future_error(std::future_errc::no_state));
+			_state->set_exception(exception);
+		}
+	};
+
+
+	/// @returns False if cancelled
+	template <typename T>
+	bool wait(const future<T>& f, const cancellation_token& token)
+	{ return f.wait(token); }
+
+
+	/// @returns False if cancelled
+	template <typename T>
+	bool wait(const shared_future<T>& f, const cancellation_token& token)
+	{ return f.wait(token); }
+}
+
+#endif
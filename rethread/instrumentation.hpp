@@ -0,0 +1,132 @@
+#ifndef RETHREAD_INSTRUMENTATION_HPP
+#define RETHREAD_INSTRUMENTATION_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/detail/config.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Instrumentation is opt-in: unless RETHREAD_USE_INSTRUMENTATION is defined, hooks compile to nothing
+#ifdef RETHREAD_USE_INSTRUMENTATION
+#define RETHREAD_INSTRUMENT(Event_, Object_, Value_) ::rethread::detail::instrument(::rethread::instrumentation_event::Event_, (Object_), (Value_))
+#define RETHREAD_INSTRUMENT_TIMER(Name_, Event_, Object_) ::rethread::detail::instrumentation_timer Name_(::rethread::instrumentation_event::Event_, (Object_))
+#else
+#define RETHREAD_INSTRUMENT(Event_, Object_, Value_) RETHREAD_MACRO_BEGIN RETHREAD_MACRO_END
+#define RETHREAD_INSTRUMENT_TIMER(Name_, Event_, Object_)
+#endif
+
+namespace rethread
+{
+	enum class instrumentation_event
+	{
+		handler_cancel,       ///< cancellation_handler::cancel() returned. Object is the handler, value is the duration in nanoseconds
+		unregister_race_lost, ///< Handler couldn't be unregistered before cancel() started. Object is the token, value is 1
+		cancel_done_wait,     ///< Unregistering thread waited for cancel() of its handler. Object is the token, value is the time in nanoseconds
+		source_cancel,        ///< cancellation_token_source::cancel() returned. Object is the source, value is the duration in nanoseconds
+		source_tokens,        ///< Number of registered tokens visited by cancellation_token_source::cancel(). Object is the source
+		cancel_done_spin,     ///< Racing cancel() finished while the unregistering thread was spinning. Object is the token, value is the number of spins
+		cancel_done_block,    ///< Unregistering thread had to block after spinning. Object is the token, value is the number of spins
+
+		count_
+	};
+
+
+	/// @brief Invoked synchronously from the thread that caused the event, so it should be fast and shouldn't block
+	using instrumentation_callback = void (*)(instrumentation_event event, const void* object, uint64_t value);
+
+
+	/// @brief Lock-free aggregate of the reported values, updated even if there's no callback
+	struct instrumentation_counter
+	{
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> total{0};
+		std::atomic<uint64_t> max{0};
+
+		void reset()
+		{
+			count.store(0, std::memory_order_relaxed);
+			total.store(0, std::memory_order_relaxed);
+			max.store(0, std::memory_order_relaxed);
+		}
+	};
+
+
+	namespace detail
+	{
+		template <typename Dummy_ = void>
+		struct instrumentation_state
+		{
+			static std::atomic<instrumentation_callback> s_callback;
+			static instrumentation_counter               s_counters[static_cast<size_t>(instrumentation_event::count_)];
+		};
+
+		template <typename Dummy_>
+		std::atomic<instrumentation_callback> instrumentation_state<Dummy_>::s_callback{nullptr};
+
+		template <typename Dummy_>
+		instrumentation_counter instrumentation_state<Dummy_>::s_counters[static_cast<size_t>(instrumentation_event::count_)];
+
+
+		inline void instrument(instrumentation_event event, const void* object, uint64_t value)
+		{
+			instrumentation_counter& c = instrumentation_state<>::s_counters[static_cast<size_t>(event)];
+			c.count.fetch_add(1, std::memory_order_relaxed);
+			c.total.fetch_add(value, std::memory_order_relaxed);
+			uint64_t max = c.max.load(std::memory_order_relaxed);
+			while (max < value && !c.max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+				;
+
+			if (instrumentation_callback callback = instrumentation_state<>::s_callback.load(std::memory_order_acquire))
+				callback(event, object, value);
+		}
+
+
+		class instrumentation_timer
+		{
+			using clock = std::chrono::steady_clock;
+
+			instrumentation_event _event;
+			const void*           _object;
+			clock::time_point     _start;
+
+		public:
+			instrumentation_timer(instrumentation_event event, const void* object) :
+				_event(event), _object(object), _start(clock::now())
+			{ }
+
+			instrumentation_timer(const instrumentation_timer&) = delete;
+			instrumentation_timer& operator = (const instrumentation_timer&) = delete;
+
+			~instrumentation_timer()
+			{ instrument(_event, _object, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start).count())); }
+		};
+	}
+
+
+	/// @brief Sets the callback for all events. Pass nullptr to remove it
+	/// @note  Has no effect unless RETHREAD_USE_INSTRUMENTATION is defined
+	inline void set_instrumentation_callback(instrumentation_callback callback)
+	{ detail::instrumentation_state<>::s_callback.store(callback, std::memory_order_release); }
+
+	inline const instrumentation_counter& get_instrumentation_counter(instrumentation_event event)
+	{ return detail::instrumentation_state<>::s_counters[static_cast<size_t>(event)]; }
+
+	inline void reset_instrumentation_counters()
+	{
+		for (instrumentation_counter& c : detail::instrumentation_state<>::s_counters)
+			c.reset();
+	}
+}
+
+#endif
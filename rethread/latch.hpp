@@ -0,0 +1,110 @@
+#ifndef RETHREAD_LATCH_HPP
+#define RETHREAD_LATCH_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/atomic.hpp>
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/futex.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+namespace rethread
+{
+	/// @brief Single-use downward counter with cancellable wait(), similar to C++20 std::latch.
+	///        count_down() is a single atomic operation unless it is the last one and someone waits.
+	///        Cancellation handler is registered only when wait() has to block.
+	class latch
+	{
+		detail::futex_word            _count;
+		mutable std::atomic<uint32_t> _waiters{0};
+
+	public:
+		explicit latch(uint32_t expected) : _count(expected)
+		{ }
+
+		latch(const latch&) = delete;
+		latch& operator = (const latch&) = delete;
+
+		static RETHREAD_CONSTEXPR uint32_t max()
+		{ return std::numeric_limits<uint32_t>::max(); }
+
+		void count_down(uint32_t update = 1)
+		{
+			uint32_t count = _count.fetch_sub(update);
+			RETHREAD_ASSERT(count >= update, "Latch counter underflow!");
+			if (count == update && _waiters.load() != 0)
+			{
+				detail::futex_wake_all(_count);
+				detail::notify_cancellable_waiters(_count);
+			}
+		}
+
+		bool try_wait() const
+		{ return _count.load(std::memory_order_acquire) == 0; }
+
+		void wait() const
+		{ wait_impl(dummy_cancellation_token()); }
+
+		/// @returns False if cancelled
+		bool wait(const cancellation_token& token) const
+		{ return wait_impl(token); }
+
+		/// @returns False if cancelled. The counter is decremented anyway
+		bool arrive_and_wait(const cancellation_token& token, uint32_t update = 1)
+		{
+			count_down(update);
+			return wait(token);
+		}
+
+		void arrive_and_wait(uint32_t update = 1)
+		{
+			count_down(update);
+			wait();
+		}
+
+	private:
+		template <typename Token>
+		bool wait_impl(const Token& token) const
+		{
+			if (try_wait())
+				return true;
+
+			detail::futex_cancellation_guard<Token> guard(_count, token);
+			if (guard.is_cancelled())
+				return false;
+
+			// Pairs with count_down(): either the waiter sees zero, or the last count_down() sees the waiter
+			_waiters.fetch_add(1);
+			bool result = true;
+			for (uint32_t count = _count.load(); count != 0; count = _count.load())
+			{
+				if (!token)
+				{
+					result = false;
+					break;
+				}
+				guard.wait(count);
+			}
+			_waiters.fetch_sub(1, std::memory_order_relaxed);
+			return result;
+		}
+	};
+
+
+	/// @returns False if cancelled
+	inline bool wait(const latch& l, const cancellation_token& token)
+	{ return l.wait(token); }
+}
+
+#endif
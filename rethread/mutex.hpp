@@ -0,0 +1,236 @@
+#ifndef RETHREAD_MUTEX_HPP
+#define RETHREAD_MUTEX_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/atomic.hpp>
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/futex.hpp>
+#include <rethread/detail/spin.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <cstdint>
+
+namespace rethread
+{
+	namespace detail
+	{
+		template <typename Predicate_>
+		bool spin_for_lock(Predicate_ tryLock)
+		{
+			static RETHREAD_CONSTEXPR unsigned SpinCount = 100;
+			for (unsigned i = 0; i < SpinCount; ++i)
+			{
+				cpu_relax();
+				if (tryLock())
+					return true;
+			}
+			return false;
+		}
+	}
+
+
+	/// @brief Futex-based mutex (the three-state one from "Futexes Are Tricky" by Ulrich Drepper) with cancellable lock().
+	///        Uncontended lock() and unlock() are a single atomic operation each. Contended lock() spins for a while, and then parks
+	///        on the futex word. Cancellable lock() parks on the word's epoch in the atomic wait table, which the cancellation handler bumps.
+	/// @note  Satisfies Lockable, so it works with std::unique_lock and rethread::wait() too
+	class mutex
+	{
+		static RETHREAD_CONSTEXPR uint32_t Unlocked = 0;
+		static RETHREAD_CONSTEXPR uint32_t Locked = 1;
+		static RETHREAD_CONSTEXPR uint32_t Contended = 2; // locked, and there may be parked waiters
+
+		detail::futex_word _state{Unlocked};
+
+	public:
+		mutex() = default;
+		mutex(const mutex&) = delete;
+		mutex& operator = (const mutex&) = delete;
+
+		bool try_lock()
+		{
+			uint32_t state = Unlocked;
+			return _state.compare_exchange_strong(state, Locked, std::memory_order_acquire, std::memory_order_relaxed);
+		}
+
+		void lock()
+		{
+			if (try_lock() || spin())
+				return;
+			while (_state.exchange(Contended, std::memory_order_acquire) != Unlocked)
+				detail::futex_wait(_state, Contended);
+		}
+
+		/// @returns False if cancelled, the mutex is not locked in this case
+		bool lock(const cancellation_token& token)
+		{
+			if (try_lock() || spin())
+				return true;
+
+			// Cancellable waiters sleep on the epoch, not on the word, so they don't consume the wake-ups of the other waiters
+			detail::futex_cancellation_guard<> guard(_state, token);
+			if (guard.is_cancelled())
+				return false;
+
+			while (_state.exchange(Contended, std::memory_order_acquire) != Unlocked)
+			{
+				if (!token)
+					return false;
+				guard.wait(Contended);
+			}
+			return true;
+		}
+
+		void unlock()
+		{
+			if (_state.exchange(Unlocked, std::memory_order_release) == Contended)
+			{
+				detail::futex_wake_one(_state);
+				detail::notify_cancellable_waiters(_state);
+			}
+		}
+
+	private:
+		bool spin()
+		{ return detail::spin_for_lock([this] { return _state.load(std::memory_order_relaxed) == Unlocked && try_lock(); }); }
+	};
+
+
+	/// @brief Futex-based readers-writer lock with cancellable lock() and lock_shared().
+	///        Pending writer blocks new readers, so that writers don't starve. Uncontended locking is a single CAS.
+	/// @note  Every unlock that sees sleeping waiters wakes all of them, since both readers and writers sleep on the same word
+	class shared_mutex
+	{
+		static RETHREAD_CONSTEXPR uint32_t WriterBit = 1u << 31;
+		static RETHREAD_CONSTEXPR uint32_t WaitersBit = 1u << 30;       // someone sleeps on the word
+		static RETHREAD_CONSTEXPR uint32_t WriterWaitingBit = 1u << 29; // writer waits, new readers shouldn't enter
+		static RETHREAD_CONSTEXPR uint32_t ReadersMask = WriterWaitingBit - 1;
+
+		detail::futex_word _state{0};
+
+	public:
+		shared_mutex() = default;
+		shared_mutex(const shared_mutex&) = delete;
+		shared_mutex& operator = (const shared_mutex&) = delete;
+
+		bool try_lock()
+		{ return try_acquire(&shared_mutex::can_lock, WriterBit); }
+
+		void lock()
+		{
+			if (!try_lock())
+				acquire(dummy_cancellation_token(), &shared_mutex::can_lock, WriterBit, WaitersBit | WriterWaitingBit);
+		}
+
+		/// @returns False if cancelled, the mutex is not locked in this case
+		bool lock(const cancellation_token& token)
+		{ return acquire(token, &shared_mutex::can_lock, WriterBit, WaitersBit | WriterWaitingBit); }
+
+		void unlock()
+		{
+			if (_state.exchange(0, std::memory_order_release) & WaitersBit)
+			{
+				detail::futex_wake_all(_state);
+				detail::notify_cancellable_waiters(_state);
+			}
+		}
+
+		bool try_lock_shared()
+		{ return try_acquire(&shared_mutex::can_lock_shared, 1); }
+
+		void lock_shared()
+		{
+			if (!try_lock_shared())
+				acquire(dummy_cancellation_token(), &shared_mutex::can_lock_shared, 1, WaitersBit);
+		}
+
+		/// @returns False if cancelled, the mutex is not locked in this case
+		bool lock_shared(const cancellation_token& token)
+		{ return acquire(token, &shared_mutex::can_lock_shared, 1, WaitersBit); }
+
+		void unlock_shared()
+		{
+			uint32_t state = _state.fetch_sub(1, std::memory_order_release) - 1;
+			// The last reader clears the waiting bits, and the woken writers set them again if they still have to wait
+			while ((state & ReadersMask) == 0 && (state & WaitersBit))
+				if (_state.compare_exchange_weak(state, state & ~(WaitersBit | WriterWaitingBit), std::memory_order_relaxed))
+				{
+					detail::futex_wake_all(_state);
+					detail::notify_cancellable_waiters(_state);
+					return;
+				}
+		}
+
+	private:
+		static bool can_lock(uint32_t state)
+		{ return (state & (WriterBit | ReadersMask)) == 0; }
+
+		static bool can_lock_shared(uint32_t state)
+		{ return (state & (WriterBit | WriterWaitingBit)) == 0 && (state & ReadersMask) != ReadersMask; }
+
+		template <typename Token>
+		bool acquire(const Token& token, bool (*canLock)(uint32_t), uint32_t lockValue, uint32_t waitBits)
+		{
+			if (try_acquire(canLock, lockValue) || detail::spin_for_lock([&] { return this->try_acquire(canLock, lockValue); }))
+				return true;
+
+			detail::futex_cancellation_guard<Token> guard(_state, token);
+			if (guard.is_cancelled())
+				return false;
+
+			uint32_t state = _state.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				if (canLock(state))
+				{
+					if (_state.compare_exchange_weak(state, locked_state(state, lockValue), std::memory_order_acquire, std::memory_order_relaxed))
+						return true;
+					continue;
+				}
+
+				if (!token)
+					return false; // whoever holds the lock wakes all sleepers on unlock, so nothing is lost here
+
+				uint32_t sleeping = state | waitBits;
+				if (sleeping != state && !_state.compare_exchange_weak(state, sleeping, std::memory_order_relaxed))
+					continue;
+				guard.wait(sleeping);
+				state = _state.load(std::memory_order_relaxed);
+			}
+		}
+
+		bool try_acquire(bool (*canLock)(uint32_t), uint32_t lockValue)
+		{
+			uint32_t state = _state.load(std::memory_order_relaxed);
+			if (!canLock(state))
+				return false;
+			return _state.compare_exchange_strong(state, locked_state(state, lockValue), std::memory_order_acquire, std::memory_order_relaxed);
+		}
+
+		// Writer drops the writer waiting bit and keeps the waiters one, so the sleepers are woken by its unlock() and set the bits again
+		static uint32_t locked_state(uint32_t state, uint32_t lockValue)
+		{ return lockValue == WriterBit ? ((state & WaitersBit) | WriterBit) : state + lockValue; }
+	};
+
+
+	/// @returns False if cancelled
+	template <typename Mutex>
+	bool lock(Mutex& m, const cancellation_token& token)
+	{ return m.lock(token); }
+
+
+	/// @returns False if cancelled
+	template <typename SharedMutex>
+	bool lock_shared(SharedMutex& m, const cancellation_token& token)
+	{ return m.lock_shared(token); }
+}
+
+#endif
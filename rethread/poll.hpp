@@ -13,15 +13,30 @@
 #include <rethread/cancellation_token.hpp>
 #include <rethread/detail/utility.hpp>
 
+#include <cerrno>
 #include <exception>
+#include <memory>
+#include <system_error>
+#include <vector>
 
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
 #if !defined(RETHREAD_DISABLE_EVENTFD)
 #include <sys/eventfd.h>
 #endif
 
+#if defined(RETHREAD_USE_IO_URING)
+#include <rethread/detail/io_uring.hpp>
+#endif
+
 namespace rethread
 {
 	namespace detail
@@ -95,25 +110,268 @@ namespace rethread
 			{ return _pipe[0]; }
 		};
 #endif
+
+
+		/// @brief Grants exclusive use of a poll_cancellation_handler cached in thread-local storage.
+		///        Handler is returned to it's original state by the cancel()/reset() contract, so it can be reused by the next poll
+		///        without recreating the descriptor. Nested usage falls back to a temporary handler.
+		class cached_poll_cancellation_handler
+		{
+			struct cache
+			{
+				poll_cancellation_handler _handler;
+				bool                      _in_use{false};
+			};
+
+			cache*                                     _cache;
+			std::unique_ptr<poll_cancellation_handler> _fallback;
+
+		public:
+			cached_poll_cancellation_handler() : _cache(&get_cache())
+			{
+				if (RETHREAD_LIKELY(!_cache->_in_use))
+					_cache->_in_use = true;
+				else
+				{
+					_cache = nullptr;
+					_fallback.reset(new poll_cancellation_handler());
+				}
+			}
+
+			~cached_poll_cancellation_handler()
+			{
+				if (_cache)
+					_cache->_in_use = false;
+			}
+
+			cached_poll_cancellation_handler(const cached_poll_cancellation_handler&) = delete;
+			cached_poll_cancellation_handler& operator = (const cached_poll_cancellation_handler&) = delete;
+
+			poll_cancellation_handler& get() const
+			{ return _cache ? _cache->_handler : *_fallback; }
+
+		private:
+			static cache& get_cache()
+			{
+				static thread_local cache instance;
+				return instance;
+			}
+		};
+
+
+		/// @brief Keeps single poll handler registered for several consecutive waits, so loops over partial transfers
+		///        don't re-register cancellation on every chunk
+		class poll_waiter
+		{
+			cached_poll_cancellation_handler _handler;
+			cancellation_guard               _guard;
+			bool                             _cancelled;
+
+		public:
+			explicit poll_waiter(const cancellation_token& token) :
+				_handler(), _guard(token, _handler.get()), _cancelled(_guard.is_cancelled())
+			{ }
+
+			poll_waiter(const poll_waiter&) = delete;
+			poll_waiter& operator = (const poll_waiter&) = delete;
+
+			bool is_cancelled() const
+			{ return _cancelled; }
+
+			/// @pre     fds should have room for nfds + 1 elements
+			/// @returns Number of descriptors in [fds, fds + nfds) with nonzero revents
+			int poll(pollfd* fds, nfds_t nfds, int timeoutMs)
+			{
+				if (_cancelled)
+				{
+					for (nfds_t i = 0; i < nfds; ++i)
+						fds[i].revents = 0;
+					return 0;
+				}
+
+				fds[nfds].fd = _handler.get().get_fd();
+				fds[nfds].events = POLLIN;
+				fds[nfds].revents = 0;
+
+				int result = ::poll(fds, nfds + 1, timeoutMs);
+				RETHREAD_CHECK(result != -1, std::system_error(errno, std::system_category()));
+				if (!fds[nfds].revents)
+					return result;
+
+				_cancelled = true;
+				return result - 1;
+			}
+
+			/// @returns Zero if cancelled, otherwise revents of fd
+			short wait(int fd, short events)
+			{
+				pollfd fds[2] = { };
+
+				fds[0].fd = fd;
+				fds[0].events = events;
+
+				poll(fds, 1, -1);
+				return _cancelled ? 0 : fds[0].revents;
+			}
+		};
+
+
+		inline bool is_retryable_error(int error)
+		{ return error == EINTR || error == EAGAIN || error == EWOULDBLOCK; }
+
+
+		/// @brief   Invokes transfer(done) until nbyte bytes are transferred, using the same registered handler for all waits
+		/// @returns Number of bytes transferred before cancellation or error, -1 if error occurred before transferring anything
+		template <typename Transfer>
+		ssize_t transfer_all(int fd, short events, size_t nbyte, const cancellation_token& token, Transfer transfer)
+		{
+			poll_waiter waiter(token);
+			size_t done = 0;
+			while (done < nbyte && waiter.wait(fd, events))
+			{
+				ssize_t result = transfer(done);
+				if (result > 0)
+					done += static_cast<size_t>(result);
+				else if (result == 0)
+					break;
+				else if (!is_retryable_error(errno))
+					return done ? static_cast<ssize_t>(done) : -1;
+			}
+			return static_cast<ssize_t>(done);
+		}
+
+
+		/// @brief   Invokes transfer(done) while it makes progress. Token is checked between the chunks, since a descriptor
+		///          that is always ready would never be polled
+		/// @returns 1 if the transfer should wait for the descriptor, 0 if it is finished or cancelled, -1 on error
+		template <typename Transfer>
+		int transfer_available(size_t nbyte, const cancellation_token& token, Transfer& transfer, size_t& done)
+		{
+			while (done < nbyte && token)
+			{
+				ssize_t result = transfer(done);
+				if (result > 0)
+					done += static_cast<size_t>(result);
+				else if (result == 0)
+					return 0;
+				else if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				else if (errno != EINTR)
+					return -1;
+			}
+			return 0;
+		}
+
+
+		/// @brief   Invokes transfer(done) until nbyte bytes are transferred, similarly to transfer_all(), but polls only when the transfer
+		///          fails with EAGAIN. The handler is registered on the first such failure, and stays registered for the rest of the loop.
+		///          wait(poll_waiter&) should return false if cancelled
+		/// @returns Number of bytes transferred before cancellation or error, -1 if error occurred before transferring anything
+		template <typename Transfer, typename Wait>
+		ssize_t transfer_all_nonblocking(size_t nbyte, const cancellation_token& token, Transfer transfer, Wait wait)
+		{
+			size_t done = 0;
+			int status = transfer_available(nbyte, token, transfer, done);
+			if (status == 1)
+			{
+				poll_waiter waiter(token);
+				while (status == 1 && wait(waiter))
+					status = transfer_available(nbyte, token, transfer, done);
+			}
+			return status == -1 && done == 0 ? -1 : static_cast<ssize_t>(done);
+		}
+
+
+		/// @brief Waits until every descriptor reports its events, since the transfer between two descriptors can't proceed otherwise
+		/// @pre   fds should have room for nfds + 1 elements
+		/// @returns False if cancelled
+		inline bool wait_all(poll_waiter& waiter, pollfd* fds, nfds_t nfds)
+		{
+			while (nfds != 0)
+			{
+				waiter.poll(fds, nfds, -1);
+				if (waiter.is_cancelled())
+					return false;
+
+				nfds_t pending = 0;
+				for (nfds_t i = 0; i < nfds; ++i)
+					if (!fds[i].revents)
+						fds[pending++] = fds[i];
+				nfds = pending;
+			}
+			return true;
+		}
+
+
+		/// @brief Position in an iovec array. Caller's array is copied only if a partial transfer has to adjust the first buffer
+		class iovec_cursor
+		{
+			const iovec*       _iov;
+			int                _count;
+			std::vector<iovec> _copy;
+
+		public:
+			iovec_cursor(const iovec* iov, int count) : _iov(iov), _count(count)
+			{ }
+
+			const iovec* get() const
+			{ return _iov; }
+
+			int count() const
+			{ return _count; }
+
+			static size_t total_size(const iovec* iov, int count)
+			{
+				size_t result = 0;
+				for (int i = 0; i < count; ++i)
+					result += iov[i].iov_len;
+				return result;
+			}
+
+			void advance(size_t nbyte)
+			{
+				while (_count != 0 && nbyte >= _iov->iov_len)
+				{
+					nbyte -= _iov->iov_len;
+					++_iov;
+					--_count;
+				}
+				if (nbyte == 0)
+					return;
+
+				if (_copy.empty())
+				{
+					_copy.assign(_iov, _iov + _count);
+					_iov = _copy.data();
+				}
+				iovec& first = _copy[_iov - _copy.data()];
+				first.iov_base = static_cast<char*>(first.iov_base) + nbyte;
+				first.iov_len -= nbyte;
+			}
+		};
 	}
 
 
+	/// @brief   Cancellable version of POSIX poll(...) for several descriptors
+	/// @pre     fds should have room for nfds + 1 elements. The last one is reserved for the cancellation descriptor and is overwritten,
+	///          so the caller's array is never copied
+	/// @returns Number of descriptors in [fds, fds + nfds) with nonzero revents. Zero if cancelled before polling
+	inline int poll(pollfd* fds, nfds_t nfds, int timeoutMs, const cancellation_token& token)
+	{ return detail::poll_waiter(token).poll(fds, nfds, timeoutMs); }
+
+
+	inline int poll(pollfd* fds, nfds_t nfds, const cancellation_token& token)
+	{ return poll(fds, nfds, -1, token); }
+
+
 	inline short poll(int fd, short events, int timeoutMs, const cancellation_token& token)
 	{
-		detail::poll_cancellation_handler handler;
-		cancellation_guard guard(token, handler);
-		if (guard.is_cancelled())
-			return 0;
-
 		pollfd fds[2] = { };
 
 		fds[0].fd = fd;
 		fds[0].events = events;
 
-		fds[1].fd = handler.get_fd();
-		fds[1].events = POLLIN;
-
-		RETHREAD_CHECK(::poll(fds, 2, timeoutMs) != -1, std::system_error(errno, std::system_category()));
+		poll(fds, 1, timeoutMs, token);
 		return fds[0].revents;
 	}
 
@@ -122,14 +380,239 @@ namespace rethread
 	{ return poll(fd, events, -1, token); }
 
 
+	// Dummy token can never be cancelled, so there's nothing to register, and the overloads below are the plain poll()
+
+
+	inline int poll(pollfd* fds, nfds_t nfds, int timeoutMs, const dummy_cancellation_token&)
+	{
+		int result = ::poll(fds, nfds, timeoutMs);
+		RETHREAD_CHECK(result != -1, std::system_error(errno, std::system_category()));
+		return result;
+	}
+
+
+	inline int poll(pollfd* fds, nfds_t nfds, const dummy_cancellation_token& token)
+	{ return poll(fds, nfds, -1, token); }
+
+
+	inline short poll(int fd, short events, int timeoutMs, const dummy_cancellation_token& token)
+	{
+		pollfd fds[1] = { };
+
+		fds[0].fd = fd;
+		fds[0].events = events;
+
+		poll(fds, 1, timeoutMs, token);
+		return fds[0].revents;
+	}
+
+
+	inline short poll(int fd, short events, const dummy_cancellation_token& token)
+	{ return poll(fd, events, -1, token); }
+
+
+	// If RETHREAD_USE_IO_URING is defined and io_uring is available, the functions below submit operations to the thread's ring
+	// instead of polling, and cancel them by IORING_OP_ASYNC_CANCEL.
+
+
 	/// @brief   Cancellable version of POSIX read(...). Uses cancellable poll to implement cancellable waiting.
 	/// @returns Zero if cancelled, otherwise read() result
 	inline ssize_t read(int fd, void* buf, size_t nbyte, const cancellation_token& token)
 	{
-		if (poll(fd, POLLIN, token) != POLLIN)
+#if defined(RETHREAD_USE_IO_URING)
+		if (detail::io_uring_ring* ring = detail::io_uring_ring::get_thread_ring())
+			return detail::io_uring_result(detail::io_uring_call(*ring, detail::io_uring_ring::make_rw(IORING_OP_READ, fd, buf, nbyte), token), 0);
+#endif
+		if (!detail::poll_waiter(token).wait(fd, POLLIN))
 			return 0;
 		return ::read(fd, buf, nbyte);
 	}
+
+
+	/// @brief   Cancellable version of POSIX write(...). Partial writes are continued until all data is written.
+	/// @note    Blocking write() may wait for the whole buffer once poll reports the descriptor writable,
+	///          so descriptor should be in non-blocking mode to be cancellable between chunks. send() doesn't have such a requirement.
+	/// @returns Number of bytes written before cancellation, or -1 if nothing was written because of error
+	inline ssize_t write(int fd, const void* buf, size_t nbyte, const cancellation_token& token)
+	{
+		const char* data = static_cast<const char*>(buf);
+#if defined(RETHREAD_USE_IO_URING)
+		if (detail::io_uring_ring* ring = detail::io_uring_ring::get_thread_ring())
+			return detail::io_uring_transfer_all(*ring, fd, POLLOUT, nbyte, token, [=] (size_t done) { return detail::io_uring_ring::make_rw(IORING_OP_WRITE, fd, data + done, nbyte - done); });
+#endif
+		return detail::transfer_all(fd, POLLOUT, nbyte, token, [=] (size_t done) { return ::write(fd, data + done, nbyte - done); });
+	}
+
+
+	/// @brief   Cancellable version of POSIX recv(...)
+	/// @returns Zero if cancelled, otherwise recv() result
+	inline ssize_t recv(int fd, void* buf, size_t nbyte, int flags, const cancellation_token& token)
+	{
+#if defined(RETHREAD_USE_IO_URING)
+		if (detail::io_uring_ring* ring = detail::io_uring_ring::get_thread_ring())
+			return detail::io_uring_result(detail::io_uring_call(*ring, detail::io_uring_ring::make_msg(IORING_OP_RECV, fd, buf, nbyte, flags), token), 0);
+#endif
+		if (!detail::poll_waiter(token).wait(fd, POLLIN))
+			return 0;
+		return ::recv(fd, buf, nbyte, flags);
+	}
+
+
+	/// @brief   Cancellable version of POSIX send(...). Partial sends are continued until all data is sent.
+	/// @returns Number of bytes sent before cancellation, or -1 if nothing was sent because of error
+	inline ssize_t send(int fd, const void* buf, size_t nbyte, int flags, const cancellation_token& token)
+	{
+		const char* data = static_cast<const char*>(buf);
+#if defined(RETHREAD_USE_IO_URING)
+		if (detail::io_uring_ring* ring = detail::io_uring_ring::get_thread_ring())
+			return detail::io_uring_transfer_all(*ring, fd, POLLOUT, nbyte, token, [=] (size_t done) { return detail::io_uring_ring::make_msg(IORING_OP_SEND, fd, data + done, nbyte - done, flags); });
+#endif
+		return detail::transfer_all(fd, POLLOUT, nbyte, token, [=] (size_t done) { return ::send(fd, data + done, nbyte - done, flags | MSG_DONTWAIT); });
+	}
+
+
+	/// @brief   Cancellable version of POSIX accept(...)
+	/// @returns -1 with errno set to ECANCELED if cancelled, otherwise accept() result
+	inline int accept(int fd, sockaddr* addr, socklen_t* addrlen, const cancellation_token& token)
+	{
+#if defined(RETHREAD_USE_IO_URING)
+		if (detail::io_uring_ring* ring = detail::io_uring_ring::get_thread_ring())
+		{
+			int res = detail::io_uring_call(*ring, detail::io_uring_ring::make_accept(fd, addr, addrlen, 0), token);
+			if (res >= 0)
+				return res;
+			errno = -res;
+			return -1;
+		}
+#endif
+		detail::poll_waiter waiter(token);
+		for (;;)
+		{
+			if (!waiter.wait(fd, POLLIN))
+			{
+				errno = ECANCELED;
+				return -1;
+			}
+
+			int result = ::accept(fd, addr, addrlen);
+			if (result != -1 || !detail::is_retryable_error(errno))
+				return result;
+		}
+	}
+
+
+	/// @brief   Cancellable version of POSIX readv(...). Unlike read(), the call is made first, and the descriptor is polled only
+	///          if it fails with EAGAIN, so the descriptor should be in non-blocking mode to be cancellable
+	/// @returns Zero if cancelled, otherwise readv() result
+	inline ssize_t readv(int fd, const iovec* iov, int iovcnt, const cancellation_token& token)
+	{
+		ssize_t result = ::readv(fd, iov, iovcnt);
+		if (result != -1 || !detail::is_retryable_error(errno))
+			return result;
+
+		detail::poll_waiter waiter(token);
+		for (;;)
+		{
+			if (!waiter.wait(fd, POLLIN))
+				return 0;
+
+			result = ::readv(fd, iov, iovcnt);
+			if (result != -1 || !detail::is_retryable_error(errno))
+				return result;
+		}
+	}
+
+
+	/// @brief   Cancellable version of POSIX writev(...). Partial writes are continued until all buffers are written.
+	///          The call is made first, and the descriptor is polled only if it fails with EAGAIN, so it should be in non-blocking mode
+	///          to be cancellable
+	/// @returns Number of bytes written before cancellation, or -1 if nothing was written because of error
+	inline ssize_t writev(int fd, const iovec* iov, int iovcnt, const cancellation_token& token)
+	{
+		detail::iovec_cursor cursor(iov, iovcnt);
+		return detail::transfer_all_nonblocking(detail::iovec_cursor::total_size(iov, iovcnt), token,
+			[&] (size_t)
+			{
+				ssize_t result = ::writev(fd, cursor.get(), cursor.count());
+				if (result > 0)
+					cursor.advance(static_cast<size_t>(result));
+				return result;
+			},
+			[=] (detail::poll_waiter& waiter) { return waiter.wait(fd, POLLOUT) != 0; });
+	}
+
+
+#if defined(__linux__)
+	/// @brief   Cancellable version of Linux sendfile(...). Continues until count bytes are sent, or the end of in_fd is reached.
+	///          The call is made first, and out_fd is polled only if it fails with EAGAIN, so out_fd should be in non-blocking mode
+	///          to be cancellable
+	/// @returns Number of bytes sent before cancellation, or -1 if nothing was sent because of error
+	inline ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count, const cancellation_token& token)
+	{
+		return detail::transfer_all_nonblocking(count, token,
+			[=] (size_t done) { return ::sendfile(out_fd, in_fd, offset, count - done); },
+			[=] (detail::poll_waiter& waiter) { return waiter.wait(out_fd, POLLOUT) != 0; });
+	}
+
+
+	/// @brief   Cancellable version of Linux splice(...). Continues until len bytes are moved, or the end of fd_in is reached.
+	///          SPLICE_F_NONBLOCK is added to flags, and the descriptors are polled only if the call fails with EAGAIN.
+	///          Non-pipe descriptors should be in non-blocking mode to be cancellable
+	/// @returns Number of bytes moved before cancellation, or -1 if nothing was moved because of error
+	inline ssize_t splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t len, unsigned int flags, const cancellation_token& token)
+	{
+		return detail::transfer_all_nonblocking(len, token,
+			[=] (size_t done) { return ::splice(fd_in, off_in, fd_out, off_out, len - done, flags | SPLICE_F_NONBLOCK); },
+			[=] (detail::poll_waiter& waiter)
+			{
+				pollfd fds[3] = { };
+				fds[0].fd = fd_in;
+				fds[0].events = POLLIN;
+				fds[1].fd = fd_out;
+				fds[1].events = POLLOUT;
+				return detail::wait_all(waiter, fds, 2);
+			});
+	}
+#endif
+
+
+	/// @brief   Cancellable version of POSIX connect(...). Socket is switched to non-blocking mode for the duration of the call.
+	/// @returns -1 with errno set to ECANCELED if cancelled, otherwise connect() result.
+	///          Connection attempt is not aborted by cancellation, so the socket should be closed afterwards
+	inline int connect(int fd, const sockaddr* addr, socklen_t addrlen, const cancellation_token& token)
+	{
+		int flags = ::fcntl(fd, F_GETFL);
+		if (flags == -1)
+			return -1;
+		if (!(flags & O_NONBLOCK) && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+			return -1;
+
+		int result = ::connect(fd, addr, addrlen);
+		if (result == -1 && errno == EINPROGRESS)
+		{
+			if (!detail::poll_waiter(token).wait(fd, POLLOUT))
+				errno = ECANCELED;
+			else
+			{
+				int error = 0;
+				socklen_t len = sizeof(error);
+				result = ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+				if (result == 0 && error != 0)
+				{
+					errno = error;
+					result = -1;
+				}
+			}
+		}
+
+		if (!(flags & O_NONBLOCK))
+		{
+			int error = errno;
+			::fcntl(fd, F_SETFL, flags);
+			errno = error;
+		}
+		return result;
+	}
 }
 
 #endif
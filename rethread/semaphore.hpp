@@ -0,0 +1,111 @@
+#ifndef RETHREAD_SEMAPHORE_HPP
+#define RETHREAD_SEMAPHORE_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/atomic.hpp>
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/futex.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+namespace rethread
+{
+	/// @brief Counting semaphore with cancellable acquire(). The count itself is the futex word that waiters sleep on,
+	///        cancellable ones sleep on its epoch in the atomic wait table instead.
+	///        Acquiring an available unit and releasing without waiters are single atomic operations each.
+	///        Cancellation handler is registered only when acquire() has to block.
+	class counting_semaphore
+	{
+		detail::futex_word    _count;
+		std::atomic<uint32_t> _waiters{0};
+
+	public:
+		explicit counting_semaphore(uint32_t desired) : _count(desired)
+		{ }
+
+		counting_semaphore(const counting_semaphore&) = delete;
+		counting_semaphore& operator = (const counting_semaphore&) = delete;
+
+		static RETHREAD_CONSTEXPR uint32_t max()
+		{ return std::numeric_limits<uint32_t>::max(); }
+
+		bool try_acquire()
+		{
+			uint32_t count = _count.load(std::memory_order_relaxed);
+			while (count != 0)
+				if (_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire, std::memory_order_relaxed))
+					return true;
+			return false;
+		}
+
+		void acquire()
+		{
+			if (!try_acquire())
+				acquire_impl(dummy_cancellation_token());
+		}
+
+		/// @returns False if cancelled, the count is not decremented in this case
+		bool acquire(const cancellation_token& token)
+		{
+			if (try_acquire())
+				return true;
+
+			return acquire_impl(token);
+		}
+
+		void release(uint32_t update = 1)
+		{
+			RETHREAD_ASSERT(update <= max() - _count.load(std::memory_order_relaxed), "Semaphore count overflow!");
+			_count.fetch_add(update);
+			if (RETHREAD_LIKELY(_waiters.load() == 0))
+				return;
+			if (update == 1)
+				detail::futex_wake_one(_count);
+			else
+				detail::futex_wake_all(_count);
+			detail::notify_cancellable_waiters(_count);
+		}
+
+	private:
+		template <typename Token>
+		bool acquire_impl(const Token& token)
+		{
+			detail::futex_cancellation_guard<Token> guard(_count, token);
+			if (guard.is_cancelled())
+				return false;
+
+			// Pairs with release(): either the waiter sees the new count, or the releaser sees the waiter
+			_waiters.fetch_add(1);
+			bool result = true;
+			while (!try_acquire())
+			{
+				if (!token)
+				{
+					result = false;
+					break;
+				}
+				guard.wait(0);
+			}
+			_waiters.fetch_sub(1, std::memory_order_relaxed);
+			return result;
+		}
+	};
+
+
+	/// @returns False if cancelled
+	inline bool acquire(counting_semaphore& s, const cancellation_token& token)
+	{ return s.acquire(token); }
+}
+
+#endif
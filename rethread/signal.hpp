@@ -0,0 +1,179 @@
+#ifndef RETHREAD_SIGNAL_HPP
+#define RETHREAD_SIGNAL_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/config.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+namespace rethread
+{
+	namespace detail
+	{
+		extern "C" inline void rethread_interrupt_signal_handler(int)
+		{ }
+
+
+		/// @brief Installs the no-op handler without SA_RESTART, so that the interrupted call fails with EINTR instead of being restarted
+		/// @note  Throws if the signal already has a handler of someone else, instead of silently breaking it
+		/// @returns Signal number
+		inline int get_interrupt_signal()
+		{
+			struct installer
+			{
+				int _signal;
+
+				installer() : _signal(RETHREAD_INTERRUPT_SIGNAL)
+				{
+					struct sigaction old = { };
+					RETHREAD_CHECK(::sigaction(_signal, nullptr, &old) == 0, std::system_error(errno, std::system_category(), "sigaction failed"));
+					const bool foreign = (old.sa_flags & SA_SIGINFO) ?
+						old.sa_sigaction != nullptr :
+						old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN && old.sa_handler != &rethread_interrupt_signal_handler;
+					RETHREAD_CHECK(!foreign, std::logic_error("RETHREAD_INTERRUPT_SIGNAL already has a handler, define it to another signal"));
+
+					struct sigaction sa = { };
+					sa.sa_handler = &rethread_interrupt_signal_handler;
+					sigemptyset(&sa.sa_mask);
+					sa.sa_flags = 0;
+					RETHREAD_CHECK(::sigaction(_signal, &sa, nullptr) == 0, std::system_error(errno, std::system_category(), "sigaction failed"));
+				}
+			};
+
+			static installer instance;
+			return instance._signal;
+		}
+
+
+		/// @brief Consumes the instances of the signal that are still pending for the calling thread, so that they don't interrupt its next blocking call.
+		///        The signal is blocked meanwhile, otherwise it would be delivered instead of staying pending
+		inline void drain_interrupt_signal(int signal)
+		{
+			sigset_t set, old;
+			sigemptyset(&set);
+			sigaddset(&set, signal);
+			int error = ::pthread_sigmask(SIG_BLOCK, &set, &old);
+			RETHREAD_CHECK(error == 0, std::system_error(error, std::system_category(), "pthread_sigmask failed"));
+
+			sigset_t pending;
+			int received;
+			while (::sigpending(&pending) == 0 && sigismember(&pending, signal) == 1)
+				::sigwait(&set, &received);
+
+			::pthread_sigmask(SIG_SETMASK, &old, nullptr);
+		}
+
+
+		/// @brief Signal may arrive right before the thread enters the call, and then it is lost.
+		///        Unlike a futex wake, a signal can't be made to stick, so the handler keeps signalling the thread until it reports that it left.
+		class signal_cancellation_handler : public cancellation_handler
+		{
+			pthread_t         _thread;
+			int               _signal;
+			std::atomic<bool> _left{false};
+			std::atomic<bool> _signalled{false};
+
+		public:
+			explicit signal_cancellation_handler(int signal) : _thread(::pthread_self()), _signal(signal)
+			{ }
+
+			void cancel() override
+			{
+				for (unsigned i = 0; !_left.load(); ++i)
+				{
+					_signalled.store(true, std::memory_order_relaxed);
+					int error = ::pthread_kill(_thread, _signal);
+					RETHREAD_CHECK(error == 0, std::system_error(error, std::system_category(), "pthread_kill failed"));
+					if (i < 16)
+						std::this_thread::yield();
+					else
+						std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+			}
+
+			void leave()
+			{ _left.store(true); }
+
+			int get_signal() const
+			{ return _signal; }
+
+			/// @pre Handler is already unregistered
+			bool is_signalled() const
+			{ return _signalled.load(std::memory_order_relaxed); }
+		};
+	}
+
+
+	/// @brief   Invokes f() until it succeeds or fails with an error other than EINTR. On cancellation the calling thread is interrupted
+	///          by RETHREAD_INTERRUPT_SIGNAL, so any blocking call that reports EINTR can be cancelled, without a descriptor to poll.
+	///          Cost of the uncancelled call is a handler registration, no extra syscalls are made. After a cancelled call the signals
+	///          that weren't delivered yet are drained, with the signal blocked meanwhile.
+	/// @note    f() should return -1 and set errno on failure. The signal shouldn't be blocked in the calling thread.
+	///          Calls in uninterruptible sleep (e.g. fsync() on a local disk) can't be interrupted, and cancel() keeps signalling until they return
+	/// @returns f() result, or -1 with errno set to ECANCELED if cancelled
+	template <typename Function>
+	auto call_interruptible(Function f, const cancellation_token& token) -> decltype(f())
+	{
+		decltype(f()) result = -1;
+		int error = ECANCELED;
+
+		detail::signal_cancellation_handler handler(detail::get_interrupt_signal());
+		{
+			cancellation_guard guard(token, handler);
+			if (!guard.is_cancelled())
+				while (token)
+				{
+					result = f();
+					error = errno;
+					if (result != -1 || error != EINTR)
+						break;
+					error = ECANCELED;
+				}
+			handler.leave(); // handler keeps signalling until the thread leaves, so it should be done before unregistering
+		}
+
+		// The handler is unregistered, so it won't send more signals, but the ones it sent may still be pending. Real-time signals
+		// are queued, and each of them would fail a later blocking call of the thread
+		if (handler.is_signalled())
+			detail::drain_interrupt_signal(handler.get_signal());
+
+		if (result == -1)
+			errno = error;
+		return result;
+	}
+
+
+	/// @brief   Cancellable version of POSIX waitpid(...)
+	/// @returns -1 with errno set to ECANCELED if cancelled, otherwise waitpid() result
+	inline pid_t waitpid(pid_t pid, int* status, int options, const cancellation_token& token)
+	{ return call_interruptible([=] { return ::waitpid(pid, status, options); }, token); }
+
+
+	/// @brief   Cancellable version of flock(...)
+	/// @returns -1 with errno set to ECANCELED if cancelled, otherwise flock() result
+	inline int flock(int fd, int operation, const cancellation_token& token)
+	{ return call_interruptible([=] { return ::flock(fd, operation); }, token); }
+}
+
+#endif
@@ -95,16 +95,16 @@ namespace this_thread
 	inline void sleep_for(const std::chrono::duration<Rep, Period>& duration)
 	{ std::this_thread::sleep_for(duration); }
 
-	template<typename Rep, typename Period>
-	inline void sleep_for(const std::chrono::duration<Rep, Period>& duration, const cancellation_token& token)
-	{ token.sleep_for(duration); }
+	template<typename Rep, typename Period, typename Token>
+	inline typename detail::enable_if_token<Token>::type sleep_for(const std::chrono::duration<Rep, Period>& duration, const Token& token)
+	{ cancellation_token_traits<Token>::sleep_for(token, std::chrono::duration_cast<std::chrono::nanoseconds>(duration)); }
 
 	template<typename Clock, typename Duration>
 	inline void sleep_until(const std::chrono::time_point<Clock, Duration>& timePoint)
 	{ std::this_thread::sleep_until(timePoint); }
 
-	template<typename Clock, typename Duration>
-	inline void sleep_until(const std::chrono::time_point<Clock, Duration>& timePoint, const cancellation_token& token)
+	template<typename Clock, typename Duration, typename Token>
+	inline typename detail::enable_if_token<Token>::type sleep_until(const std::chrono::time_point<Clock, Duration>& timePoint, const Token& token)
 	{ sleep_for(timePoint - Clock::now(), token); }
 }
 }
@@ -0,0 +1,172 @@
+#ifndef RETHREAD_THREAD_GROUP_HPP
+#define RETHREAD_THREAD_GROUP_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/aligned_allocation.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace rethread
+{
+	namespace detail
+	{
+		/// @brief Throws std::invalid_argument if the CPU index doesn't fit the affinity mask of the platform
+		inline void check_pinnable_cpu(unsigned cpu)
+		{
+#if defined(__linux__)
+			RETHREAD_CHECK(cpu < CPU_SETSIZE, std::invalid_argument("CPU index doesn't fit cpu_set_t"));
+#elif defined(_WIN32)
+			RETHREAD_CHECK(cpu < sizeof(DWORD_PTR) * 8, std::invalid_argument("CPU index doesn't fit the affinity mask"));
+#else
+			(void)cpu;
+#endif
+		}
+
+
+		/// @pre  check_pinnable_cpu(cpu) passed
+		/// @note Does nothing on platforms other than Linux and Windows
+		inline void pin_this_thread(unsigned cpu)
+		{
+#if defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			int error = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+			RETHREAD_CHECK(error == 0, std::system_error(error, std::system_category(), "pthread_setaffinity_np failed"));
+#elif defined(_WIN32)
+			RETHREAD_CHECK(::SetThreadAffinityMask(::GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0, std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "SetThreadAffinityMask failed"));
+#else
+			(void)cpu;
+#endif
+		}
+
+
+		/// @brief Pins the thread that invokes it before calling the function, so that none of the user code runs on another CPU
+		template <typename Function>
+		class pinned_function
+		{
+			unsigned _cpu;
+			Function _f;
+
+		public:
+			pinned_function(unsigned cpu, Function f) : _cpu(cpu), _f(std::move(f))
+			{ }
+
+			template <typename... Args>
+			void operator ()(Args&&... args)
+			{
+				pin_this_thread(_cpu);
+				_f(std::forward<Args>(args)...);
+			}
+		};
+	}
+
+
+	/// @brief Threads that share a single cancellation_token_source. Each thread is invoked as f(args..., const cancellation_token&).
+	///        Shutdown cancels all of them in a single fan-out, and only then joins them, so it takes as long as the slowest thread
+	///        needs to exit, instead of the sum of their exit latencies, as with a vector of rethread::thread.
+	/// @note  Tokens are kept in a deque, which allocates them in blocks and never moves them
+	class thread_group
+	{
+		using token_deque = std::deque<sourced_cancellation_token, detail::aligned_allocator<sourced_cancellation_token>>;
+
+		cancellation_token_source _source;
+		cancellation_fan_out      _fan_out;
+		token_deque               _tokens;
+		std::vector<std::thread>  _threads;
+
+	public:
+		explicit thread_group(cancellation_fan_out fanOut = cancellation_fan_out::batched) : _fan_out(fanOut)
+		{ }
+
+		thread_group(const thread_group&) = delete;
+		thread_group& operator = (const thread_group&) = delete;
+
+		~thread_group()
+		{ reset(); }
+
+		template<class Function, class... Args>
+		void create_thread(Function&& f, Args&&... args)
+		{ spawn(std::forward<Function>(f), std::forward<Args>(args)...); }
+
+		/// @brief Same as create_thread(), but the new thread pins itself to the given CPU before invoking f
+		/// @note  Pinning is implemented for Linux and Windows, elsewhere the thread is not pinned. The CPU index is checked here,
+		///        and std::invalid_argument is thrown if it doesn't fit the affinity mask. If the new thread still fails to pin itself
+		///        (e.g. the CPU is offline or not allowed for the process), the exception escapes the thread function and terminates
+		template<class Function, class... Args>
+		void create_thread_pinned(unsigned cpu, Function&& f, Args&&... args)
+		{
+			detail::check_pinnable_cpu(cpu);
+			using pinned = detail::pinned_function<typename std::decay<Function>::type>;
+			spawn(pinned(cpu, std::forward<Function>(f)), std::forward<Args>(args)...);
+		}
+
+		size_t size() const
+		{ return _threads.size(); }
+
+		bool empty() const
+		{ return _threads.empty(); }
+
+		/// @brief Cancels all threads in a single fan-out. Threads created afterwards see their tokens cancelled right away
+		void cancel()
+		{ _source.cancel(_fan_out); }
+
+		/// @brief Waits for all threads without cancelling them
+		void join_all()
+		{
+			for (std::thread& t : _threads)
+				t.join();
+			_threads.clear();
+			_tokens.clear(); // threads are joined, so nobody uses the tokens
+		}
+
+		/// @brief Cancels and joins all threads. The group can be reused afterwards
+		void reset()
+		{
+			if (_threads.empty())
+				return;
+
+			cancel();
+			join_all();
+			_source.reset();
+		}
+
+	private:
+		template<class Function, class... Args>
+		void spawn(Function&& f, Args&&... args)
+		{
+			// Reserved in advance, so that a failure after the token is created can come only from the thread constructor
+			if (_threads.size() == _threads.capacity())
+				_threads.reserve(std::max<size_t>(8, _threads.size() * 2));
+			_tokens.push_back(_source.create_token());
+			_threads.emplace_back(std::forward<Function>(f), std::forward<Args>(args)..., std::cref(_tokens.back()));
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef RETHREAD_THREAD_POOL_HPP
+#define RETHREAD_THREAD_POOL_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/condition_variable.hpp>
+#include <rethread/thread.hpp>
+#include <rethread/detail/aligned_allocation.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rethread
+{
+	namespace detail
+	{
+		/// @brief Type-erased task. Function and its token share a single allocation
+		class thread_pool_task
+		{
+			standalone_cancellation_token _token;
+
+		public:
+			virtual ~thread_pool_task() { }
+
+			virtual void run(const cancellation_token& token) = 0;
+
+			standalone_cancellation_token& get_token()
+			{ return _token; }
+		};
+
+
+		template <typename Function_>
+		class thread_pool_task_impl : public thread_pool_task
+		{
+			Function_ _func;
+
+		public:
+			template <typename F_>
+			explicit thread_pool_task_impl(F_&& f) : _func(std::forward<F_>(f))
+			{ }
+
+			void run(const cancellation_token& token) override
+			{ _func(token); }
+		};
+	}
+
+
+	/// @brief Fixed set of rethread::thread workers with per-worker work-stealing deques.
+	///        Submitted function is invoked as f(const cancellation_token&). The token is cancelled either if the task is cancelled
+	///        via its task_handle, or if the whole pool is cancelled.
+	/// @note  Tasks that are cancelled before they start are not invoked at all
+	class thread_pool
+	{
+		using task_ptr = std::shared_ptr<detail::thread_pool_task>;
+
+		struct worker
+		{
+			std::mutex                 _mutex;
+			std::deque<task_ptr>       _tasks;         // submitted to the back, taken from the front, so that the oldest tasks don't starve
+			bool                       _closed{false}; // set by cancel() while it drains the tasks
+			sourced_cancellation_token _pool_token;
+
+			explicit worker(sourced_cancellation_token poolToken) : _pool_token(std::move(poolToken))
+			{ }
+
+			RETHREAD_TOKEN_ALIGNED_NEW
+		};
+
+		using worker_ptr = std::unique_ptr<worker>;
+
+	public:
+		class task_handle
+		{
+			task_ptr _task;
+
+		public:
+			task_handle()
+			{ }
+
+			/// @brief Cancels the task's token. Does nothing if the task has already finished
+			void cancel()
+			{
+				if (_task)
+					_task->get_token().cancel();
+			}
+
+			explicit operator bool() const
+			{ return static_cast<bool>(_task); }
+
+		private:
+			explicit task_handle(task_ptr task) : _task(std::move(task))
+			{ }
+
+			friend class thread_pool;
+		};
+
+	private:
+		cancellation_token_source _source;
+		std::atomic<bool>         _cancelled{false};
+		std::vector<worker_ptr>   _workers;
+		std::atomic<size_t>       _next_worker{0};
+
+		std::mutex                _mutex; // guards sleeping of idle workers
+		std::condition_variable   _cv;
+		std::atomic<size_t>       _queued{0};
+		std::atomic<size_t>       _sleepers{0};
+
+		std::vector<thread>       _threads;
+
+	public:
+		/// @param threads Number of workers. Zero means hardware concurrency
+		explicit thread_pool(size_t threads = 0)
+		{
+			if (threads == 0)
+				threads = std::max(thread::hardware_concurrency(), 1u);
+
+			for (size_t i = 0; i < threads; ++i)
+				_workers.push_back(worker_ptr(new worker(_source.create_token())));
+			for (size_t i = 0; i < threads; ++i)
+				_threads.push_back(thread(&thread_pool::worker_func, this, i));
+		}
+
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator = (const thread_pool&) = delete;
+
+		~thread_pool()
+		{
+			cancel();
+			_threads.clear(); // cancels and joins workers
+		}
+
+		size_t size() const
+		{ return _workers.size(); }
+
+		/// @brief Schedules f(const cancellation_token&)
+		/// @returns Handle that can cancel this particular task. If the pool is cancelled, the task is never invoked
+		template <typename Function>
+		task_handle submit(Function&& f)
+		{
+			using task_type = detail::thread_pool_task_impl<typename std::decay<Function>::type>;
+			// Task holds a token, which may be over-aligned, and make_shared() ignores that before C++17
+			task_ptr task = std::allocate_shared<task_type>(detail::aligned_allocator<task_type>(), std::forward<Function>(f));
+			if (_cancelled.load(std::memory_order_relaxed))
+			{
+				task->get_token().cancel();
+				return task_handle(std::move(task));
+			}
+
+			// Counted before it's pushed, so that a worker that pops the task can't decrement the counter first.
+			// Pairs with wait_for_work(): either the sleeper sees the new task, or we see the sleeper
+			_queued.fetch_add(1);
+			worker& w = *_workers[_next_worker.fetch_add(1, std::memory_order_relaxed) % _workers.size()];
+			{
+				std::unique_lock<std::mutex> l(w._mutex);
+				if (RETHREAD_UNLIKELY(w._closed)) // cancel() has already drained this worker, so nobody would run the task
+				{
+					l.unlock();
+					_queued.fetch_sub(1);
+					task->get_token().cancel();
+					return task_handle(std::move(task));
+				}
+				w._tasks.push_back(task);
+			}
+
+			if (_sleepers.load() != 0)
+			{
+				std::unique_lock<std::mutex> l(_mutex);
+				_cv.notify_one();
+			}
+			return task_handle(std::move(task));
+		}
+
+		/// @brief Cancels all running tasks and discards pending ones. Tasks submitted afterwards are discarded too
+		void cancel()
+		{
+			if (_cancelled.exchange(true))
+				return;
+
+			_source.cancel(cancellation_fan_out::batched);
+			for (const worker_ptr& w : _workers)
+			{
+				std::deque<task_ptr> tasks;
+				{
+					std::unique_lock<std::mutex> l(w->_mutex);
+					w->_closed = true;
+					tasks.swap(w->_tasks);
+				}
+				_queued.fetch_sub(tasks.size());
+				for (const task_ptr& task : tasks)
+					task->get_token().cancel();
+			}
+		}
+
+	private:
+		void worker_func(size_t index, const cancellation_token& token)
+		{
+			worker& w = *_workers[index];
+			while (token)
+			{
+				task_ptr task = pop(index);
+				if (task)
+					run(w, *task);
+				else
+					wait_for_work(token);
+			}
+		}
+
+		void run(worker& w, detail::thread_pool_task& task)
+		{
+			standalone_cancellation_token& taskToken = task.get_token();
+			// Inline callback cancels the task token directly, or right away if the pool is cancelled already
+			detail::cancellation_link poolLink;
+			poolLink.attach(taskToken, w._pool_token);
+			if (taskToken)
+				task.run(taskToken);
+		}
+
+		task_ptr pop(size_t index)
+		{
+			task_ptr result = try_take(*_workers[index]);
+			for (size_t i = 1; !result && i < _workers.size(); ++i)
+				result = try_take(*_workers[(index + i) % _workers.size()]);
+			if (result)
+				_queued.fetch_sub(1, std::memory_order_relaxed);
+			return result;
+		}
+
+		// Owner and thieves both take the oldest task, every deque is a mutex-protected FIFO
+		static task_ptr try_take(worker& w)
+		{
+			std::unique_lock<std::mutex> l(w._mutex);
+			if (w._tasks.empty())
+				return task_ptr();
+			task_ptr result = std::move(w._tasks.front());
+			w._tasks.pop_front();
+			return result;
+		}
+
+		void wait_for_work(const cancellation_token& token)
+		{
+			std::unique_lock<std::mutex> l(_mutex);
+			_sleepers.fetch_add(1);
+			rethread::wait(_cv, l, token, [this] { return _queued.load() != 0; });
+			_sleepers.fetch_sub(1);
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef RETHREAD_WIN32_HPP
+#define RETHREAD_WIN32_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// Winsock 2 should be included before windows.h, which may be included by the futex implementation
+#include <winsock2.h>
+#include <windows.h>
+
+#if defined(_MSC_VER)
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/detail/utility.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+namespace rethread
+{
+	namespace detail
+	{
+		inline std::system_error make_win32_error(const char* what)
+		{ return std::system_error(static_cast<int>(::GetLastError()), std::system_category(), what); }
+
+
+		/// @brief Manual-reset event object
+		class win32_event
+		{
+			HANDLE _event;
+
+		public:
+			win32_event() : _event(::CreateEventW(nullptr, TRUE, FALSE, nullptr))
+			{ RETHREAD_CHECK(_event != nullptr, make_win32_error("CreateEvent failed")); }
+
+			~win32_event()
+			{ RETHREAD_CHECK(::CloseHandle(_event), make_win32_error("CloseHandle failed")); }
+
+			win32_event(const win32_event&) = delete;
+			win32_event& operator = (const win32_event&) = delete;
+
+			void set()
+			{ RETHREAD_CHECK(::SetEvent(_event), make_win32_error("SetEvent failed")); }
+
+			void reset()
+			{ RETHREAD_CHECK(::ResetEvent(_event), make_win32_error("ResetEvent failed")); }
+
+			HANDLE get_handle() const
+			{ return _event; }
+		};
+
+
+		/// @brief Signals an event object, so it can be waited together with other handles
+		class event_cancellation_handler : public cancellation_handler
+		{
+			win32_event _event;
+
+		public:
+			void cancel() override
+			{ _event.set(); }
+
+			void reset() override
+			{ _event.reset(); }
+
+			HANDLE get_handle() const
+			{ return _event.get_handle(); }
+		};
+
+
+		/// @brief Events of the cancellation handler and of the overlapped I/O, cached in thread-local storage the same way as
+		///        cached_poll_cancellation_handler does. Nested usage falls back to temporary events.
+		class cached_win32_events
+		{
+		public:
+			struct events
+			{
+				event_cancellation_handler _handler;
+				win32_event                _io;
+				bool                       _in_use{false};
+			};
+
+		private:
+			events*                 _cache;
+			std::unique_ptr<events> _fallback;
+
+		public:
+			cached_win32_events() : _cache(&get_cache())
+			{
+				if (RETHREAD_LIKELY(!_cache->_in_use))
+					_cache->_in_use = true;
+				else
+				{
+					_cache = nullptr;
+					_fallback.reset(new events());
+				}
+			}
+
+			~cached_win32_events()
+			{
+				if (_cache)
+					_cache->_in_use = false;
+			}
+
+			cached_win32_events(const cached_win32_events&) = delete;
+			cached_win32_events& operator = (const cached_win32_events&) = delete;
+
+			events& get() const
+			{ return _cache ? *_cache : *_fallback; }
+
+		private:
+			static events& get_cache()
+			{
+				static thread_local events instance;
+				return instance;
+			}
+		};
+
+
+		/// @brief Keeps the event handler registered for several consecutive waits, similarly to poll_waiter
+		class win32_waiter
+		{
+			cached_win32_events _events;
+			cancellation_guard  _guard;
+			bool                _cancelled;
+
+		public:
+			explicit win32_waiter(const cancellation_token& token) :
+				_events(), _guard(token, _events.get()._handler), _cancelled(_guard.is_cancelled())
+			{ }
+
+			win32_waiter(const win32_waiter&) = delete;
+			win32_waiter& operator = (const win32_waiter&) = delete;
+
+			bool is_cancelled() const
+			{ return _cancelled; }
+
+			win32_event& get_io_event() const
+			{ return _events.get()._io; }
+
+			/// @returns WaitForMultipleObjects() result, or WAIT_FAILED with ERROR_OPERATION_ABORTED if cancelled
+			DWORD wait(DWORD count, const HANDLE* handles, DWORD timeoutMs)
+			{
+				RETHREAD_CHECK(count < MAXIMUM_WAIT_OBJECTS, std::invalid_argument("Too many handles, one is reserved for cancellation"));
+				if (_cancelled)
+					return cancelled();
+
+				HANDLE all[MAXIMUM_WAIT_OBJECTS];
+				std::copy(handles, handles + count, all);
+				all[count] = _events.get()._handler.get_handle();
+
+				// Lowest index wins if several objects are signaled, so the cancellation doesn't hide ready handles
+				DWORD result = ::WaitForMultipleObjects(count + 1, all, FALSE, timeoutMs);
+				if (result != WAIT_OBJECT_0 + count)
+					return result;
+
+				_cancelled = true;
+				return cancelled();
+			}
+
+		private:
+			static DWORD cancelled()
+			{
+				::SetLastError(ERROR_OPERATION_ABORTED);
+				return WAIT_FAILED;
+			}
+		};
+
+
+		/// @brief   Runs overlapped socket operation and waits for its completion or cancellation. Cancelled operation is aborted by
+		///          CancelIoEx(), and its completion is still awaited, so the buffer is not used after return
+		/// @returns Number of bytes transferred, zero if cancelled, SOCKET_ERROR with WSAGetLastError() set on error
+		template <typename Start_>
+		int overlapped_call(win32_waiter& waiter, SOCKET s, Start_ start)
+		{
+			if (waiter.is_cancelled())
+				return 0;
+
+			win32_event& io = waiter.get_io_event();
+			io.reset();
+
+			WSAOVERLAPPED overlapped = { };
+			// Low bit keeps the completion out of the I/O completion port that the socket may be associated with
+			overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<std::uintptr_t>(io.get_handle()) | 1);
+
+			DWORD bytes = 0;
+			if (start(&overlapped, &bytes) == 0)
+				return static_cast<int>(bytes);
+			if (::WSAGetLastError() != WSA_IO_PENDING)
+				return SOCKET_ERROR;
+
+			HANDLE handle = io.get_handle();
+			if (waiter.wait(1, &handle, INFINITE) != WAIT_OBJECT_0)
+			{
+				::CancelIoEx(reinterpret_cast<HANDLE>(s), reinterpret_cast<LPOVERLAPPED>(&overlapped));
+				::WaitForSingleObject(handle, INFINITE);
+			}
+
+			DWORD flags = 0;
+			if (::WSAGetOverlappedResult(s, &overlapped, &bytes, FALSE, &flags))
+				return static_cast<int>(bytes);
+			if (::WSAGetLastError() == WSA_OPERATION_ABORTED && waiter.is_cancelled())
+				return 0;
+			return SOCKET_ERROR;
+		}
+	}
+
+
+	/// @brief   Cancellable version of WaitForMultipleObjects(..., FALSE, ...). Waiting for all objects is not supported,
+	///          since the cancellation event would have to be signaled too
+	/// @pre     count should be less than MAXIMUM_WAIT_OBJECTS, one slot is reserved for the cancellation event
+	/// @returns WaitForMultipleObjects() result, or WAIT_FAILED with GetLastError() set to ERROR_OPERATION_ABORTED if cancelled
+	inline DWORD wait_for_multiple_objects(DWORD count, const HANDLE* handles, DWORD timeoutMs, const cancellation_token& token)
+	{ return detail::win32_waiter(token).wait(count, handles, timeoutMs); }
+
+
+	inline DWORD wait_for_multiple_objects(DWORD count, const HANDLE* handles, const cancellation_token& token)
+	{ return wait_for_multiple_objects(count, handles, INFINITE, token); }
+
+
+	inline DWORD wait_for_single_object(HANDLE handle, DWORD timeoutMs, const cancellation_token& token)
+	{ return wait_for_multiple_objects(1, &handle, timeoutMs, token); }
+
+
+	inline DWORD wait_for_single_object(HANDLE handle, const cancellation_token& token)
+	{ return wait_for_single_object(handle, INFINITE, token); }
+
+
+	/// @brief   Cancellable recv(). Uses overlapped WSARecv(), so the socket should be created with WSA_FLAG_OVERLAPPED
+	///          (socket() does it by default)
+	/// @returns Zero if cancelled, otherwise recv() result
+	inline int recv(SOCKET s, void* buf, int len, int flags, const cancellation_token& token)
+	{
+		detail::win32_waiter waiter(token);
+		WSABUF buffer = { static_cast<ULONG>(len), static_cast<char*>(buf) };
+		DWORD recvFlags = static_cast<DWORD>(flags);
+		return detail::overlapped_call(waiter, s, [&] (WSAOVERLAPPED* overlapped, DWORD* bytes)
+			{ return ::WSARecv(s, &buffer, 1, bytes, &recvFlags, overlapped, nullptr); });
+	}
+
+
+	/// @brief   Cancellable send(). Partial sends are continued until all data is sent, using the same registered handler
+	/// @returns Number of bytes sent before cancellation, or SOCKET_ERROR if nothing was sent because of error
+	inline int send(SOCKET s, const void* buf, int len, int flags, const cancellation_token& token)
+	{
+		detail::win32_waiter waiter(token);
+		const char* data = static_cast<const char*>(buf);
+		int done = 0;
+		while (done < len)
+		{
+			WSABUF buffer = { static_cast<ULONG>(len - done), const_cast<char*>(data + done) };
+			int result = detail::overlapped_call(waiter, s, [&] (WSAOVERLAPPED* overlapped, DWORD* bytes)
+				{ return ::WSASend(s, &buffer, 1, bytes, static_cast<DWORD>(flags), overlapped, nullptr); });
+			if (result > 0)
+				done += result;
+			else if (result == 0)
+				break;
+			else
+				return done ? done : SOCKET_ERROR;
+		}
+		return done;
+	}
+}
+
+#endif
@@ -0,0 +1,129 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/cancellation_token.hpp>
+#include <rethread/thread.hpp>
+
+#include "test.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace rethread;
+
+namespace
+{
+	// Takes a while to cancel, so that the owner of the guard loses the unregister race and has to wait for it
+	class slow_handler : public cancellation_handler
+	{
+		std::atomic<bool> _started{false};
+		std::atomic<bool> _finished{false};
+
+	public:
+		void cancel() override
+		{
+			_started = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			_finished = true;
+		}
+
+		bool is_started() const
+		{ return _started; }
+
+		bool is_finished() const
+		{ return _finished; }
+	};
+
+
+	class counting_handler : public cancellation_handler
+	{
+		std::atomic<size_t>& _cancelled;
+
+	public:
+		explicit counting_handler(std::atomic<size_t>& cancelled) : _cancelled(cancelled)
+		{ }
+
+		void cancel() override
+		{ ++_cancelled; }
+	};
+
+
+	template <typename Token, typename Cancel>
+	bool waits_for_running_cancel(const Token& token, Cancel cancel)
+	{
+		slow_handler handler;
+		std::thread canceller;
+		{
+			cancellation_guard guard(token, handler);
+			canceller = std::thread(cancel);
+			while (!handler.is_started())
+				std::this_thread::yield();
+		}
+		bool result = handler.is_finished();
+		canceller.join();
+		return result;
+	}
+}
+
+
+RETHREAD_TEST(sourced_unregister_waits_for_cancel)
+{
+	cancellation_token_source source;
+	sourced_cancellation_token token = source.create_token();
+	RETHREAD_EXPECT(waits_for_running_cancel(token, [&] { source.cancel(); }));
+}
+
+
+// Timed out sleep leaves a waiter mark in the token, which shouldn't be mistaken for a finished cancel
+RETHREAD_TEST(sourced_unregister_waits_for_cancel_after_timed_out_sleep)
+{
+	cancellation_token_source source;
+	sourced_cancellation_token token = source.create_token();
+	this_thread::sleep_for(std::chrono::milliseconds(1), token);
+	RETHREAD_EXPECT(waits_for_running_cancel(token, [&] { source.cancel(); }));
+}
+
+
+RETHREAD_TEST(standalone_unregister_waits_for_cancel_after_timed_out_sleep)
+{
+	standalone_cancellation_token token;
+	this_thread::sleep_for(std::chrono::milliseconds(1), token);
+	RETHREAD_EXPECT(waits_for_running_cancel(token, [&] { token.cancel(); }));
+}
+
+
+RETHREAD_TEST(parallel_cancel_reaches_every_handler)
+{
+	for (size_t count : { 1, 100, 3 * RETHREAD_PARALLEL_CANCEL_HANDLERS_PER_THREAD + 1 })
+	{
+		cancellation_token_source source;
+		std::atomic<size_t> cancelled{0};
+		std::vector<sourced_cancellation_token> tokens;
+		std::vector<std::unique_ptr<counting_handler>> handlers;
+		std::vector<std::unique_ptr<cancellation_guard>> guards;
+		tokens.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			tokens.push_back(source.create_token());
+			handlers.emplace_back(new counting_handler(cancelled));
+			guards.emplace_back(new cancellation_guard(tokens.back(), *handlers.back()));
+		}
+		source.cancel(cancellation_fan_out::parallel, 4);
+		RETHREAD_EXPECT(cancelled == count);
+		guards.clear();
+	}
+}
+
+
+int main()
+{ return rethread_test::run_all(); }
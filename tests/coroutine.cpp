@@ -0,0 +1,118 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/coroutine.hpp>
+
+#include "test.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <memory>
+#include <thread>
+
+using namespace rethread;
+
+namespace
+{
+	// Starts right away and destroys its frame on completion
+	struct detached_task
+	{
+		struct promise_type
+		{
+			detached_task get_return_object() { return detached_task(); }
+			std::suspend_never initial_suspend() { return std::suspend_never(); }
+			std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+			void return_void() { }
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+
+	bool wait_for_flag(const std::atomic<bool>& flag)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (!flag && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return flag;
+	}
+
+
+	template <typename Token>
+	detached_task await_and_destroy(std::unique_ptr<Token> token, std::atomic<bool>& done)
+	{
+		co_await *token;
+		token.reset();
+		done = true;
+	}
+
+
+	template <typename Token>
+	detached_task sleep_and_destroy(std::unique_ptr<Token> token, std::atomic<bool>& slept, std::atomic<bool>& done)
+	{
+		slept = co_await this_coroutine::sleep_for(std::chrono::hours(1), *token);
+		token.reset();
+		done = true;
+	}
+}
+
+
+RETHREAD_TEST(destroys_standalone_token_on_resume)
+{
+	std::atomic<bool> done{false};
+	std::unique_ptr<standalone_cancellation_token> token(new standalone_cancellation_token());
+	standalone_cancellation_token& t = *token;
+	await_and_destroy(std::move(token), done);
+	RETHREAD_EXPECT(!done);
+
+	t.cancel();
+	RETHREAD_EXPECT(wait_for_flag(done));
+}
+
+
+RETHREAD_TEST(destroys_sourced_token_on_resume)
+{
+	for (cancellation_fan_out fanOut : { cancellation_fan_out::sequential, cancellation_fan_out::batched, cancellation_fan_out::parallel })
+	{
+		cancellation_token_source source;
+		std::atomic<bool> done{false};
+		await_and_destroy(std::unique_ptr<sourced_cancellation_token>(new sourced_cancellation_token(source.create_token())), done);
+		RETHREAD_EXPECT(!done);
+
+		source.cancel(fanOut);
+		RETHREAD_EXPECT(wait_for_flag(done));
+	}
+}
+
+
+RETHREAD_TEST(destroys_token_on_cancelled_sleep)
+{
+	std::atomic<bool> slept{true};
+	std::atomic<bool> done{false};
+	std::unique_ptr<standalone_cancellation_token> token(new standalone_cancellation_token());
+	standalone_cancellation_token& t = *token;
+	sleep_and_destroy(std::move(token), slept, done);
+
+	t.cancel();
+	RETHREAD_EXPECT(wait_for_flag(done));
+	RETHREAD_EXPECT(!slept);
+}
+
+
+RETHREAD_TEST(destroys_deadline_token_on_resume)
+{
+	std::atomic<bool> done{false};
+	await_and_destroy(std::unique_ptr<deadline_cancellation_token>(new deadline_cancellation_token(std::chrono::milliseconds(1))), done);
+	RETHREAD_EXPECT(wait_for_flag(done));
+}
+
+
+int main()
+{ return rethread_test::run_all(); }
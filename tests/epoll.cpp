@@ -0,0 +1,152 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/deadline_cancellation_token.hpp>
+#include <rethread/epoll.hpp>
+
+#include "test.hpp"
+
+#include <chrono>
+#include <coroutine>
+#include <utility>
+
+#include <unistd.h>
+
+using namespace rethread;
+
+namespace
+{
+	// Starts right away and stays alive until the owner destroys it
+	class owned_task
+	{
+	public:
+		struct promise_type
+		{
+			owned_task get_return_object() { return owned_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_never initial_suspend() { return std::suspend_never(); }
+			std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+			void return_void() { }
+			void unhandled_exception() { std::terminate(); }
+		};
+
+	private:
+		std::coroutine_handle<promise_type> _handle;
+
+	public:
+		owned_task() = default;
+
+		explicit owned_task(std::coroutine_handle<promise_type> handle) : _handle(handle)
+		{ }
+
+		owned_task(owned_task&& other) : _handle(std::exchange(other._handle, nullptr))
+		{ }
+
+		owned_task& operator = (owned_task&& other)
+		{
+			reset();
+			_handle = std::exchange(other._handle, nullptr);
+			return *this;
+		}
+
+		~owned_task()
+		{ reset(); }
+
+		void reset()
+		{
+			if (_handle)
+				_handle.destroy();
+			_handle = nullptr;
+		}
+
+		bool done() const
+		{ return _handle.done(); }
+	};
+
+
+	class pipe_fds
+	{
+		int _fds[2];
+
+	public:
+		pipe_fds()
+		{ RETHREAD_EXPECT(::pipe(_fds) == 0); }
+
+		~pipe_fds()
+		{
+			::close(_fds[0]);
+			::close(_fds[1]);
+		}
+
+		int read_fd() const
+		{ return _fds[0]; }
+
+		void make_readable()
+		{ RETHREAD_EXPECT(::write(_fds[1], "x", 1) == 1); }
+	};
+
+
+	owned_task wait_readable(coroutine_reactor& reactor, int fd, const cancellation_token& token, uint32_t& events)
+	{ events = co_await reactor.async_wait(fd, EPOLLIN, token); }
+
+	owned_task wait_and_destroy(coroutine_reactor& reactor, int fd, const cancellation_token& token, owned_task& victim)
+	{
+		co_await reactor.async_wait(fd, EPOLLIN, token);
+		victim.reset();
+	}
+
+	void run_for(coroutine_reactor& reactor, std::chrono::milliseconds duration)
+	{
+		deadline_cancellation_token token(duration);
+		reactor.run(token);
+	}
+}
+
+
+RETHREAD_TEST(destroys_coroutine_in_the_middle_of_wait)
+{
+	coroutine_reactor reactor;
+	standalone_cancellation_token token;
+	pipe_fds p;
+	uint32_t events = 0;
+	owned_task task = wait_readable(reactor, p.read_fd(), token, events);
+	RETHREAD_EXPECT(!task.done());
+
+	task.reset();
+	p.make_readable();
+	run_for(reactor, std::chrono::milliseconds(50));
+
+	// Descriptor is not registered anymore, so it can be waited for again
+	task = wait_readable(reactor, p.read_fd(), token, events);
+	run_for(reactor, std::chrono::milliseconds(50));
+	RETHREAD_EXPECT(task.done());
+	RETHREAD_EXPECT((events & EPOLLIN) != 0);
+}
+
+
+// Epoll reports ready descriptors in the order they became ready, so the killer is resumed first
+RETHREAD_TEST(destroys_coroutine_that_is_ready_in_the_same_batch)
+{
+	coroutine_reactor reactor;
+	standalone_cancellation_token token;
+	pipe_fds first, second;
+	uint32_t events = 0;
+	owned_task victim = wait_readable(reactor, second.read_fd(), token, events);
+	owned_task killer = wait_and_destroy(reactor, first.read_fd(), token, victim);
+
+	first.make_readable();
+	second.make_readable();
+	run_for(reactor, std::chrono::milliseconds(50));
+	RETHREAD_EXPECT(killer.done());
+	RETHREAD_EXPECT(events == 0);
+}
+
+
+int main()
+{ return rethread_test::run_all(); }
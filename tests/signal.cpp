@@ -0,0 +1,102 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/signal.hpp>
+
+#include "test.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+
+using namespace rethread;
+
+namespace
+{
+	extern "C" void foreign_handler(int)
+	{ }
+
+	bool is_interrupt_signal_pending()
+	{
+		sigset_t pending;
+		::sigpending(&pending);
+		return sigismember(&pending, RETHREAD_INTERRUPT_SIGNAL) == 1;
+	}
+}
+
+
+// Runs first, before the no-op handler is installed
+RETHREAD_TEST(foreign_handler_is_not_replaced)
+{
+	struct sigaction sa = { };
+	sa.sa_handler = &foreign_handler;
+	sigemptyset(&sa.sa_mask);
+	::sigaction(RETHREAD_INTERRUPT_SIGNAL, &sa, nullptr);
+
+	bool thrown = false;
+	try
+	{ detail::get_interrupt_signal(); }
+	catch (const std::logic_error&)
+	{ thrown = true; }
+	RETHREAD_EXPECT(thrown);
+
+	struct sigaction current = { };
+	::sigaction(RETHREAD_INTERRUPT_SIGNAL, nullptr, &current);
+	RETHREAD_EXPECT(current.sa_handler == &foreign_handler);
+
+	sa.sa_handler = SIG_DFL;
+	::sigaction(RETHREAD_INTERRUPT_SIGNAL, &sa, nullptr);
+	RETHREAD_EXPECT(detail::get_interrupt_signal() == RETHREAD_INTERRUPT_SIGNAL);
+}
+
+
+RETHREAD_TEST(queued_signals_are_drained)
+{
+	const int signal = detail::get_interrupt_signal();
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, signal);
+	::pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (int i = 0; i < 3; ++i)
+		::pthread_kill(::pthread_self(), signal);
+	RETHREAD_EXPECT(is_interrupt_signal_pending());
+
+	detail::drain_interrupt_signal(signal);
+	RETHREAD_EXPECT(!is_interrupt_signal_pending());
+	::pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+
+RETHREAD_TEST(cancelled_call_does_not_interrupt_the_next_one)
+{
+	const pid_t child = ::fork();
+	if (child == 0)
+	{
+		::pause();
+		::_exit(0);
+	}
+
+	standalone_cancellation_token token;
+	std::thread canceller([&] { std::this_thread::sleep_for(std::chrono::milliseconds(50)); token.cancel(); });
+	int status = 0;
+	RETHREAD_EXPECT(rethread::waitpid(child, &status, 0, token) == -1 && errno == ECANCELED);
+	canceller.join();
+	RETHREAD_EXPECT(::poll(nullptr, 0, 50) == 0);
+
+	::kill(child, SIGKILL);
+	::waitpid(child, &status, 0);
+}
+
+
+int main()
+{ return rethread_test::run_all(); }
@@ -0,0 +1,101 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/barrier.hpp>
+#include <rethread/latch.hpp>
+#include <rethread/mutex.hpp>
+#include <rethread/semaphore.hpp>
+
+#include "test.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace rethread;
+
+namespace
+{
+	// Blocks wait(token) in another thread, then cancels it
+	template <typename Wait>
+	bool cancelled_wait_returns_false(Wait wait)
+	{
+		standalone_cancellation_token token;
+		std::atomic<int> result{-1};
+		std::thread waiter([&] { result = wait(token) ? 1 : 0; });
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		token.cancel();
+		waiter.join();
+		return result == 0;
+	}
+}
+
+
+RETHREAD_TEST(cancellable_waits_are_cancelled)
+{
+	mutex m;
+	m.lock();
+	RETHREAD_EXPECT(cancelled_wait_returns_false([&] (const cancellation_token& t) { return m.lock(t); }));
+	m.unlock();
+
+	shared_mutex sm;
+	sm.lock();
+	RETHREAD_EXPECT(cancelled_wait_returns_false([&] (const cancellation_token& t) { return sm.lock_shared(t); }));
+	sm.unlock();
+
+	counting_semaphore s(0);
+	RETHREAD_EXPECT(cancelled_wait_returns_false([&] (const cancellation_token& t) { return s.acquire(t); }));
+
+	latch l(1);
+	RETHREAD_EXPECT(cancelled_wait_returns_false([&] (const cancellation_token& t) { return l.wait(t); }));
+
+	barrier<> b(2);
+	RETHREAD_EXPECT(cancelled_wait_returns_false([&] (const cancellation_token& t) { return b.arrive_and_wait(t); }));
+
+	std::atomic<uint32_t> word{0};
+	RETHREAD_EXPECT(cancelled_wait_returns_false([&] (const cancellation_token& t)
+		{
+			while (word.load() == 0)
+				if (!futex_wait(word, 0, t))
+					return false;
+			return true;
+		}));
+}
+
+
+// Plain waiters sleep on the word and cancellable ones on its epoch, so every release has to reach both kinds
+RETHREAD_TEST(release_wakes_plain_and_cancellable_waiters)
+{
+	counting_semaphore s(0);
+	standalone_cancellation_token token;
+	std::atomic<int> acquired{0};
+	std::thread plain([&] { s.acquire(); ++acquired; });
+	std::thread cancellable([&] { if (s.acquire(token)) ++acquired; });
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	s.release();
+	s.release();
+	plain.join();
+	cancellable.join();
+	RETHREAD_EXPECT(acquired == 2);
+
+	mutex m;
+	m.lock();
+	std::thread plainLock([&] { m.lock(); ++acquired; m.unlock(); });
+	std::thread cancellableLock([&] { if (m.lock(token)) { ++acquired; m.unlock(); } });
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	m.unlock();
+	plainLock.join();
+	cancellableLock.join();
+	RETHREAD_EXPECT(acquired == 4);
+}
+
+
+int main()
+{ return rethread_test::run_all(); }
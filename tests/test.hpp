@@ -0,0 +1,73 @@
+#ifndef RETHREAD_TESTS_TEST_HPP
+#define RETHREAD_TESTS_TEST_HPP
+
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <cstdio>
+#include <vector>
+
+// Minimal test registry, so that the tests don't depend on any framework
+namespace rethread_test
+{
+	struct test_case
+	{
+		const char* _name;
+		void      (*_func)();
+	};
+
+	inline std::vector<test_case>& get_tests()
+	{
+		static std::vector<test_case> tests;
+		return tests;
+	}
+
+	inline int& get_failures()
+	{
+		static int failures = 0;
+		return failures;
+	}
+
+	struct test_registrar
+	{
+		test_registrar(const char* name, void (*func)())
+		{ get_tests().push_back(test_case{name, func}); }
+	};
+
+	inline void report_failure(const char* expression, const char* file, int line)
+	{
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+		++get_failures();
+	}
+
+	/// @returns Exit code of the test executable
+	inline int run_all()
+	{
+		for (const test_case& test : get_tests())
+		{
+			int failures = get_failures();
+			std::printf("[ RUN      ] %s\n", test._name);
+			std::fflush(stdout); // failures are reported to stderr
+			test._func();
+			std::printf("%s %s\n", get_failures() == failures ? "[       OK ]" : "[  FAILED  ]", test._name);
+		}
+		return get_failures() == 0 ? 0 : 1;
+	}
+}
+
+#define RETHREAD_TEST(Name_) \
+	static void Name_(); \
+	static const rethread_test::test_registrar Name_##_registrar(#Name_, &Name_); \
+	static void Name_()
+
+#define RETHREAD_EXPECT(...) \
+	do { if (!(__VA_ARGS__)) rethread_test::report_failure(#__VA_ARGS__, __FILE__, __LINE__); } while (false)
+
+#endif
@@ -0,0 +1,48 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/thread_group.hpp>
+
+#include "test.hpp"
+
+#include <atomic>
+#include <stdexcept>
+
+#include <sched.h>
+
+using namespace rethread;
+
+
+// The thread should already run on the CPU when the user code starts, instead of being moved there later
+RETHREAD_TEST(pinned_thread_starts_on_its_cpu)
+{
+	std::atomic<int> cpu{-1};
+	thread_group group;
+	group.create_thread_pinned(0, [] (std::atomic<int>* out, const cancellation_token&) { *out = ::sched_getcpu(); }, &cpu);
+	group.join_all();
+	RETHREAD_EXPECT(cpu == 0);
+}
+
+
+RETHREAD_TEST(out_of_range_cpu_is_rejected)
+{
+	thread_group group;
+	bool thrown = false;
+	try
+	{ group.create_thread_pinned(CPU_SETSIZE, [] (const cancellation_token&) { }); }
+	catch (const std::invalid_argument&)
+	{ thrown = true; }
+	RETHREAD_EXPECT(thrown);
+	RETHREAD_EXPECT(group.empty());
+}
+
+
+int main()
+{ return rethread_test::run_all(); }
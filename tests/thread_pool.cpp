@@ -0,0 +1,78 @@
+// Copyright (c) 2016, Boris Sazonov
+//
+// Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+// provided that the above copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS.
+// IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+// WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <rethread/thread_pool.hpp>
+
+#include "test.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace rethread;
+
+
+// Tasks that race with cancel() are either drained by it, or rejected by submit(). None of them may stay queued
+RETHREAD_TEST(submit_racing_with_cancel_leaves_nothing_queued)
+{
+	for (int iteration = 0; iteration < 50; ++iteration)
+	{
+		std::shared_ptr<int> sentinel = std::make_shared<int>(0);
+		{
+			thread_pool pool(2);
+			std::atomic<bool> go{false};
+			std::vector<std::thread> submitters;
+			for (int i = 0; i < 3; ++i)
+				submitters.push_back(std::thread([&]
+					{
+						while (!go)
+							std::this_thread::yield();
+						for (int j = 0; j < 200; ++j)
+						{
+							std::shared_ptr<int> s = sentinel;
+							pool.submit([s] (const cancellation_token&) { });
+						}
+					}));
+			go = true;
+			pool.cancel();
+			for (std::thread& t : submitters)
+				t.join();
+
+			// Running tasks finish quickly, and everything else must be released by now
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (sentinel.use_count() != 1 && std::chrono::steady_clock::now() < deadline)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			RETHREAD_EXPECT(sentinel.use_count() == 1);
+		}
+	}
+}
+
+
+RETHREAD_TEST(tasks_of_a_worker_run_in_submission_order)
+{
+	thread_pool pool(1);
+	std::atomic<bool> release{false};
+	std::atomic<int> next{0};
+	std::atomic<bool> ordered{true};
+	pool.submit([&] (const cancellation_token&) { while (!release) std::this_thread::yield(); });
+	const int count = 100;
+	for (int i = 0; i < count; ++i)
+		pool.submit([&, i] (const cancellation_token&) { if (next.fetch_add(1) != i) ordered = false; });
+	release = true;
+	while (next < count)
+		std::this_thread::yield();
+	RETHREAD_EXPECT(ordered);
+}
+
+
+int main()
+{ return rethread_test::run_all(); }